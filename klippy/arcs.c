@@ -0,0 +1,120 @@
+// G-Code arc (G2/G3) segmentation
+//
+// Copyright (C) 2017  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+//
+// This code converts an arc in the XY plane into a series of linear
+// moves.  The number of moves is chosen so that the distance between
+// each move and the true arc (the sagitta of each chord) does not
+// exceed a given tolerance.  Any Z and E movement is spread linearly
+// over the arc (so helical moves are also supported).
+
+#include <math.h> // atan2
+#include "arcs.h" // arc_segments
+#include "pyhelper.h" // errorf
+
+// Angular travel below this is considered a full circle
+#define ARC_ANGULAR_TRAVEL_EPSILON 5E-7
+// Maximum distance of the end position from the arc's circle (the
+// end is rejected if it is off by more than ARC_RADIUS_ERROR_MAX, or
+// by more than both ARC_RADIUS_ERROR_MIN and ARC_RADIUS_ERROR_RATIO
+// of the radius - as done in grbl)
+#define ARC_RADIUS_ERROR_MAX 0.5
+#define ARC_RADIUS_ERROR_MIN 0.005
+#define ARC_RADIUS_ERROR_RATIO 0.001
+
+// Determine the center offset (from the start position) of an arc
+// specified by its radius.  A negative radius selects the arc that
+// travels more than 180 degrees.
+static int
+arc_center_from_radius(double x_d, double y_d, double radius, int clockwise
+                       , double *offset_i, double *offset_j)
+{
+    double h_x2_div_d = 4. * radius * radius - x_d * x_d - y_d * y_d;
+    if (h_x2_div_d < 0. || (!x_d && !y_d))
+        return -1;
+    double h = -sqrt(h_x2_div_d) / sqrt(x_d * x_d + y_d * y_d);
+    if (!clockwise)
+        h = -h;
+    if (radius < 0.)
+        h = -h;
+    *offset_i = 0.5 * (x_d - y_d * h);
+    *offset_j = 0.5 * (y_d + x_d * h);
+    return 0;
+}
+
+// Fill 'coords' with the X, Y, Z, E end positions of the linear moves
+// that approximate an arc.  If 'radius' is non-zero it specifies the
+// arc, otherwise 'offset_i' and 'offset_j' are the center of the arc
+// relative to the start position.  Returns the number of moves, or
+// one of the ARC_ERROR_x codes (see arcs.h) if the arc is not valid or
+// needs more than 'max_count' moves.
+int
+arc_segments(double *coords, int max_count
+             , double start_x, double start_y, double start_z, double start_e
+             , double end_x, double end_y, double end_z, double end_e
+             , double offset_i, double offset_j, double radius
+             , int clockwise, double tolerance)
+{
+    if (max_count < 1) {
+        errorf("arc_segments invalid max_count %d", max_count);
+        return -1;
+    }
+    if (radius) {
+        int ret = arc_center_from_radius(end_x - start_x, end_y - start_y
+                                         , radius, clockwise
+                                         , &offset_i, &offset_j);
+        if (ret)
+            return ARC_ERROR_INVALID;
+    }
+    double center_x = start_x + offset_i, center_y = start_y + offset_j;
+    double r_x = -offset_i, r_y = -offset_j;
+    double rt_x = end_x - center_x, rt_y = end_y - center_y;
+    double arc_r = sqrt(r_x * r_x + r_y * r_y);
+    if (!arc_r)
+        return ARC_ERROR_INVALID;
+    double r_error = fabs(sqrt(rt_x * rt_x + rt_y * rt_y) - arc_r);
+    if (r_error > ARC_RADIUS_ERROR_MAX
+        || (r_error > ARC_RADIUS_ERROR_MIN
+            && r_error > ARC_RADIUS_ERROR_RATIO * arc_r))
+        return ARC_ERROR_RADIUS;
+
+    // Determine the angle (and direction) of travel
+    double angular_travel = atan2(r_x * rt_y - r_y * rt_x
+                                  , r_x * rt_x + r_y * rt_y);
+    if (clockwise) {
+        if (angular_travel >= -ARC_ANGULAR_TRAVEL_EPSILON)
+            angular_travel -= 2. * M_PI;
+    } else {
+        if (angular_travel <= ARC_ANGULAR_TRAVEL_EPSILON)
+            angular_travel += 2. * M_PI;
+    }
+
+    // Determine the number of segments from the chord tolerance
+    double seg_angle = M_PI;
+    if (tolerance < arc_r)
+        seg_angle = 2. * acos(1. - tolerance / arc_r);
+    double segs = ceil(fabs(angular_travel) / seg_angle);
+    if (segs > max_count)
+        return ARC_ERROR_SEGMENTS;
+    int count = segs;
+
+    // Generate the end position of each segment
+    double start_angle = atan2(-offset_j, -offset_i);
+    double inv_count = 1. / count;
+    int i;
+    for (i=1; i<count; i++) {
+        double r = i * inv_count, angle = start_angle + angular_travel * r;
+        *coords++ = center_x + arc_r * cos(angle);
+        *coords++ = center_y + arc_r * sin(angle);
+        *coords++ = start_z + (end_z - start_z) * r;
+        *coords++ = start_e + (end_e - start_e) * r;
+    }
+    // The last segment ends exactly at the requested position
+    *coords++ = end_x;
+    *coords++ = end_y;
+    *coords++ = end_z;
+    *coords++ = end_e;
+    return count;
+}
@@ -0,0 +1,14 @@
+#ifndef ARCS_H
+#define ARCS_H
+
+enum {
+    ARC_ERROR_INVALID = -1, ARC_ERROR_RADIUS = -2, ARC_ERROR_SEGMENTS = -3,
+};
+
+int arc_segments(double *coords, int max_count
+    , double start_x, double start_y, double start_z, double start_e
+    , double end_x, double end_y, double end_z, double end_e
+    , double offset_i, double offset_j, double radius
+    , int clockwise, double tolerance);
+
+#endif // arcs.h
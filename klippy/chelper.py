@@ -3,7 +3,7 @@
 # Copyright (C) 2016,2017  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, logging
+import sys, os, glob, shutil, optparse, logging
 import cffi
 
 
@@ -11,10 +11,14 @@ import cffi
 # c_helper.so compiling
 ######################################################################
 
-COMPILE_CMD = "gcc -Wall -g -O2 -shared -fPIC -o %s %s"
-SOURCE_FILES = ['stepcompress.c', 'serialqueue.c', 'pyhelper.c']
+COMPILE_CMD = "gcc -Wall -g -O2 -shared -fPIC -o %s %s -lrt"
+SOURCE_FILES = ['stepcompress.c', 'serialqueue.c', 'pyhelper.c', 'vmcu.c'
+                , 'lookahead.c', 'extruder.c', 'kinematics.c', 'arcs.c'
+                , 'gcodeparse.c']
 DEST_LIB = "c_helper.so"
-OTHER_FILES = ['list.h', 'serialqueue.h', 'pyhelper.h']
+OTHER_FILES = ['list.h', 'serialqueue.h', 'pyhelper.h', 'vmcu.h'
+               , 'lookahead.h', 'stepcompress.h', 'extruder.h', 'kinematics.h'
+               , 'arcs.h', 'gcodeparse.h', 'shmring.h']
 
 defs_stepcompress = """
     struct stepcompress *stepcompress_alloc(uint32_t max_error
@@ -39,6 +43,53 @@ defs_stepcompress = """
     void steppersync_set_time(struct steppersync *ss
         , double time_offset, double mcu_freq);
     int steppersync_flush(struct steppersync *ss, uint64_t move_clock);
+    void steppersync_set_move_seq(struct steppersync *ss, int move_seq);
+    void steppersync_note_move_status(struct steppersync *ss
+        , uint64_t done_clock, int free_count, int alloc_seq
+        , uint64_t hold_clock);
+    void steppersync_set_vmcu(struct steppersync *ss, struct vmcu *vm);
+"""
+
+defs_vmcu = """
+    struct vmcu *vmcu_alloc(uint32_t queue_step_msgid
+        , uint32_t set_next_step_dir_msgid, uint32_t reset_step_clock_msgid);
+    void vmcu_free(struct vmcu *vm);
+    int vmcu_process(struct vmcu *vm, uint8_t *msg, int len);
+    int vmcu_extract_steps(struct vmcu *vm, uint32_t oid, uint64_t *clocks
+        , int32_t *positions, int max);
+"""
+
+# The python code reads 'struct lookahead_move' directly, so its
+# definition is taken from lookahead.h (see get_header_struct())
+defs_lookahead = """
+    struct lookahead *lookahead_alloc(double junction_deviation);
+    void lookahead_free(struct lookahead *la);
+    void lookahead_reset(struct lookahead *la);
+    struct lookahead_move *lookahead_get_moves(struct lookahead *la);
+    double lookahead_add_move(struct lookahead *la, double start_x
+        , double start_y, double start_z, double end_x, double end_y
+        , double end_z, double move_d, int is_kinematic_move, double accel
+        , double max_cruise_v2, double delta_v2, double smooth_delta_v2
+        , double extruder_v2);
+    int lookahead_flush(struct lookahead *la, int lazy);
+    void lookahead_pop(struct lookahead *la, int move_count, int flush_count);
+
+    int extruder_lookahead(struct lookahead_move *moves, int flush_count
+        , int lazy, double lookahead_t);
+    int32_t extruder_move(struct stepcompress *sc, struct lookahead_move *m
+        , double print_time, double *commanded_pos, double inv_step_dist
+        , double *extrude_pos, double move_start_pos, double axis_d
+        , double extrude_r, double pressure_advance);
+
+    struct kinematics *kinematics_alloc(const char *name);
+    void kinematics_free(struct kinematics *k);
+    void kinematics_add_stepper(struct kinematics *k, int axis
+        , struct stepcompress *sc, double *commanded_pos
+        , double inv_step_dist);
+    void kinematics_set_tower(struct kinematics *k, int axis, double x
+        , double y, double arm2);
+    int32_t kinematics_move(struct kinematics *k, struct lookahead_move *m
+        , double print_time);
 """
 
 defs_serialqueue = """
@@ -50,6 +101,7 @@ defs_serialqueue = """
     };
 
     struct serialqueue *serialqueue_alloc(int serial_fd, int write_only);
+    struct serialqueue *serialqueue_alloc_shm(const char *name);
     void serialqueue_exit(struct serialqueue *sq);
     void serialqueue_free(struct serialqueue *sq);
     struct command_queue *serialqueue_alloc_commandqueue(void);
@@ -71,6 +123,8 @@ defs_serialqueue = """
 defs_pyhelper = """
     void set_python_logging_callback(void (*func)(const char *));
     double get_monotonic(void);
+    int reactor_timerfd_create(void);
+    int reactor_timerfd_set(int fd, double waketime);
 """
 
 # Return the list of file modification times
@@ -99,27 +153,163 @@ FFI_main = None
 FFI_lib = None
 pyhelper_logging_callback = None
 
+ALL_DEFS = [defs_stepcompress, defs_lookahead, defs_serialqueue, defs_vmcu
+            , defs_pyhelper]
+# Headers that are passed to cffi in full
+HEADER_DEFS = ['arcs.h', 'gcodeparse.h']
+
+# Return the definition of a C struct as found in a header file
+def get_header_struct(srcdir, header, name):
+    f = open(os.path.join(srcdir, header), 'r')
+    data = f.read()
+    f.close()
+    start = data.index("struct %s {" % (name,))
+    end = data.index("\n};", start) + 3
+    return data[start:end]
+
+# Return the declarations in a header file (without its preprocessor
+# lines)
+def get_header_defs(srcdir, header):
+    f = open(os.path.join(srcdir, header), 'r')
+    lines = f.readlines()
+    f.close()
+    return "".join([l for l in lines if not l.startswith('#')])
+
+# Create the cffi interface for the C helper code
+def build_ffi(srcdir):
+    ffi = cffi.FFI()
+    ffi.cdef(get_header_struct(srcdir, 'lookahead.h', 'lookahead_move'))
+    for header in HEADER_DEFS:
+        ffi.cdef(get_header_defs(srcdir, header))
+    for defs in ALL_DEFS:
+        ffi.cdef(defs)
+    return ffi
+
+# Compile (if needed) and load c_helper.so using cffi's ABI mode
+def load_abi_library(srcdir):
+    check_build_code(srcdir, DEST_LIB, SOURCE_FILES, COMPILE_CMD, OTHER_FILES)
+    ffi = build_ffi(srcdir)
+    return ffi, ffi.dlopen(os.path.join(srcdir, DEST_LIB))
+
+# Check if a module was built with -fprofile-generate (such a module
+# is left behind if a "make chelper-pgo" does not complete)
+def is_profile_generate_build(filename):
+    f = open(filename, 'rb')
+    data = f.read()
+    f.close()
+    return b'__gcov_' in data
+
+# Load the ahead-of-time built API mode module (if it is up to date)
+def load_api_module(srcdir):
+    try:
+        module = __import__(API_MODULE)
+    except ImportError:
+        return None
+    src_times = get_mtimes(srcdir, SOURCE_FILES + OTHER_FILES + API_FILES)
+    if max(src_times) > os.path.getmtime(module.__file__):
+        logging.warn("C helper module %s is out of date - not using it"
+                     " (rebuild with 'make -C klippy chelper')"
+                     , module.__file__)
+        return None
+    if is_profile_generate_build(module.__file__):
+        logging.warn("C helper module %s is an instrumented (profile"
+                     " generating) build - not using it (rebuild with"
+                     " 'make -C klippy chelper')", module.__file__)
+        return None
+    return module.ffi, module.lib
+
 # Return the Foreign Function Interface api to the caller
 def get_ffi():
     global FFI_main, FFI_lib, pyhelper_logging_callback
     if FFI_lib is None:
         srcdir = os.path.dirname(os.path.realpath(__file__))
-        check_build_code(srcdir, DEST_LIB, SOURCE_FILES, COMPILE_CMD
-                         , OTHER_FILES)
-        FFI_main = cffi.FFI()
-        FFI_main.cdef(defs_stepcompress)
-        FFI_main.cdef(defs_serialqueue)
-        FFI_main.cdef(defs_pyhelper)
-        FFI_lib = FFI_main.dlopen(os.path.join(srcdir, DEST_LIB))
+        res = load_api_module(srcdir)
+        if res is None:
+            res = load_abi_library(srcdir)
+        FFI_main, FFI_lib = res
         # Setup error logging
         def logging_callback(msg):
             logging.error(FFI_main.string(msg))
         pyhelper_logging_callback = FFI_main.callback(
-            "void(const char *)", logging_callback)
+            "void(*)(const char *)", logging_callback)
         FFI_lib.set_python_logging_callback(pyhelper_logging_callback)
     return FFI_main, FFI_lib
 
 
+######################################################################
+# Ahead-of-time build of the API mode module
+######################################################################
+
+# The API mode module is a python extension that calls the C helper
+# functions directly (avoiding the libffi call overhead of ABI mode).
+# It is built with "make -C klippy chelper" and, when present and up
+# to date, it is used instead of c_helper.so.
+API_MODULE = "_chelper"
+API_FILES = ['chelper.py']
+API_BUILD_DIR = "build-chelper"
+API_CFLAGS = ['-Wall', '-g', '-O2']
+API_NATIVE_CFLAGS = ['-Wall', '-g', '-O3', '-march=native']
+API_PREAMBLE = """
+#include <stdint.h>
+#include "arcs.h"
+#include "extruder.h"
+#include "gcodeparse.h"
+#include "kinematics.h"
+#include "lookahead.h"
+#include "pyhelper.h"
+#include "serialqueue.h"
+#include "stepcompress.h"
+#include "vmcu.h"
+"""
+
+def build_api_module(srcdir, native=False, lto=False, profile=None):
+    cflags = list(API_NATIVE_CFLAGS if native else API_CFLAGS)
+    if lto:
+        cflags.append('-flto')
+    builddir = os.path.join(srcdir, API_BUILD_DIR)
+    if profile == 'generate':
+        # Discard the results of any earlier profile run
+        for root, dirs, files in os.walk(builddir):
+            for fname in files:
+                if fname.endswith('.gcda'):
+                    os.remove(os.path.join(root, fname))
+        cflags.append('-fprofile-generate')
+    elif profile == 'use':
+        # The serialqueue thread makes the counters slightly inexact
+        cflags += ['-fprofile-use', '-fprofile-correction']
+    ffi = build_ffi(srcdir)
+    # The generated wrappers are compiled against the C headers
+    ffi.set_source(API_MODULE, API_PREAMBLE
+        , sources=[os.path.join(srcdir, fname) for fname in SOURCE_FILES]
+        , include_dirs=[srcdir], libraries=['rt'], extra_compile_args=cflags
+        , extra_link_args=cflags)
+    libpath = ffi.compile(tmpdir=builddir)
+    # Install the module next to this file (replacing any old version)
+    for fname in glob.glob(os.path.join(srcdir, API_MODULE + ".*")):
+        os.remove(fname)
+    destlib = os.path.join(srcdir, os.path.basename(libpath))
+    shutil.copy2(libpath, destlib)
+    return destlib
+
+def main():
+    usage = "%prog [options]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-n", "--native", action="store_true", dest="native",
+                    help="optimize with -O3 for the build machine's cpu")
+    opts.add_option("-l", "--lto", action="store_true", dest="lto",
+                    help="use link time optimization")
+    opts.add_option("-p", "--profile", type="choice", dest="profile",
+                    choices=['generate', 'use'],
+                    help="profile guided build stage (generate or use)")
+    options, args = opts.parse_args()
+    if args:
+        opts.error("Incorrect number of arguments")
+    srcdir = os.path.dirname(os.path.realpath(__file__))
+    destlib = build_api_module(srcdir, options.native, options.lto
+                               , options.profile)
+    sys.stdout.write("Built %s\n" % (destlib,))
+
+
 ######################################################################
 # hub-ctrl hub power controller
 ######################################################################
@@ -135,3 +325,6 @@ def run_hub_ctrl(enable_power):
     hubdir = os.path.join(srcdir, HC_SOURCE_DIR)
     check_build_code(hubdir, HC_TARGET, HC_SOURCE_FILES, HC_COMPILE_CMD)
     os.system(HC_CMD % (hubdir, enable_power))
+
+if __name__ == '__main__':
+    main()
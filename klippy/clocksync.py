@@ -7,8 +7,17 @@ import logging, threading, math
 
 COMM_TIMEOUT = 3.5
 RTT_AGE = .000010 / (60. * 60.)
+# Weight of one second of samples in the regression (samples are
+# weighted by the time since the previous sample)
 DECAY = 1. / (2. * 60.)
 TRANSMIT_EXTRA = .001
+BURST_COUNT = 32
+BURST_INTERVAL = .002
+BURST_TIMEOUT = 1.
+NOMINAL_FREQ_VARIANCE = 1.
+STATUS_MIN_INTERVAL = .100
+STATUS_MAX_INTERVAL = 1.
+STATUS_DRIFT_TARGET = .000010
 
 class ClockSync:
     def __init__(self, reactor):
@@ -16,6 +25,7 @@ class ClockSync:
         self.serial = None
         self.status_timer = self.reactor.register_timer(self._status_event)
         self.status_cmd = None
+        self.status_callbacks = []
         self.mcu_freq = 1.
         self.last_clock = 0
         self.clock_est = (0., 0., 0.)
@@ -27,6 +37,8 @@ class ClockSync:
         self.clock_avg = self.clock_covariance = 0.
         self.prediction_variance = 0.
         self.last_prediction_time = 0.
+        self.last_sample_time = 0.
+        self.status_interval = STATUS_MIN_INTERVAL
     def connect(self, serial):
         self.serial = serial
         msgparser = serial.msgparser
@@ -36,15 +48,12 @@ class ClockSync:
         params = serial.send_with_response(uptime_msg, 'uptime')
         self.last_clock = (params['high'] << 32) | params['clock']
         self.clock_avg = self.last_clock
-        self.time_avg = params['#sent_time']
+        self.time_avg = self.last_sample_time = params['#sent_time']
         self.clock_est = (self.time_avg, self.clock_avg, self.mcu_freq)
         self.prediction_variance = (.001 * self.mcu_freq)**2
-        # Enable periodic get_status timer
+        # Calibrate from a burst of queries and enable periodic queries
         self.status_cmd = msgparser.create_command('get_status')
-        for i in range(8):
-            params = serial.send_with_response(self.status_cmd, 'status')
-            self._handle_status(params)
-            self.reactor.pause(0.100)
+        self._calibrate_burst()
         serial.register_callback(self._handle_status, 'status')
         self.reactor.update_timer(self.status_timer, self.reactor.NOW)
     def connect_file(self, serial, pace=False):
@@ -55,17 +64,80 @@ class ClockSync:
         if pace:
             freq = self.mcu_freq
         serial.set_clock_est(freq, self.reactor.monotonic(), 0)
+    def register_status_callback(self, cb):
+        # Callback is invoked (from background thread) with the 64bit
+        # clock and parameters of each status report
+        self.status_callbacks.append(cb)
+    # Initial clock calibration
+    def _calibrate_burst(self):
+        # Send a rapid series of get_status queries
+        samples = []
+        completion = self.reactor.completion()
+        def handle_burst_status(params):
+            # Called from background thread
+            clock = self._extend_clock(params['clock'])
+            for cb in self.status_callbacks:
+                cb(clock, params)
+            if params['#sent_time']:
+                samples.append((params['#sent_time'],
+                                params['#receive_time'], clock))
+            if len(samples) >= BURST_COUNT:
+                self.reactor.async_complete(completion, True)
+        self.serial.register_callback(handle_burst_status, 'status')
+        start_time = self.reactor.monotonic()
+        for i in range(BURST_COUNT):
+            self.serial.send(self.status_cmd)
+            self.reactor.pause(self.reactor.monotonic() + BURST_INTERVAL)
+        completion.wait(start_time + BURST_TIMEOUT)
+        self.serial.unregister_callback('status')
+        samples = list(samples)
+        if not samples:
+            logging.info("No clock calibration samples received")
+            return
+        # Seed the regression from the sample with the lowest rtt and
+        # the nominal frequency (the burst is too short to measure it)
+        sent_time, receive_time, clock = min(
+            samples, key=(lambda s: s[1] - s[0]))
+        half_rtt = .5 * (receive_time - sent_time)
+        self.min_half_rtt = half_rtt
+        self.min_rtt_time = sent_time
+        self.time_avg = sent_time
+        self.clock_avg = clock
+        self.time_variance = NOMINAL_FREQ_VARIANCE
+        self.clock_covariance = NOMINAL_FREQ_VARIANCE * self.mcu_freq
+        # Initial prediction variance from the spread of all samples
+        diff2 = [(c - clock - (st - sent_time) * self.mcu_freq)**2
+                 for st, rt, c in samples]
+        self.prediction_variance = max(sum(diff2) / len(diff2),
+                                       (half_rtt * self.mcu_freq)**2)
+        self.last_prediction_time = sent_time
+        self.last_sample_time = max([st for st, rt, c in samples])
+        pred_stddev = math.sqrt(self.prediction_variance)
+        self.serial.set_clock_est(self.mcu_freq, self.time_avg + TRANSMIT_EXTRA,
+                                  int(self.clock_avg - 3. * pred_stddev))
+        self.clock_est = (self.time_avg + half_rtt, self.clock_avg,
+                          self.mcu_freq)
+        self.status_interval = STATUS_MIN_INTERVAL
+        logging.info("Clock calibration: %d samples in %.3fs"
+                     " min_half_rtt=%.6f (error bound +/-%.6f) stddev=%.6f",
+                     len(samples), self.reactor.monotonic() - start_time,
+                     half_rtt, half_rtt, pred_stddev / self.mcu_freq)
     # MCU clock querying (status callback invoked from background thread)
     def _status_event(self, eventtime):
         self.serial.send(self.status_cmd)
-        return eventtime + 1.0
-    def _handle_status(self, params):
+        return eventtime + self.status_interval
+    def _extend_clock(self, clock32):
         # Extend clock to 64bit
         last_clock = self.last_clock
-        clock = (last_clock & ~0xffffffff) | params['clock']
+        clock = (last_clock & ~0xffffffff) | clock32
         if clock < last_clock:
             clock += 0x100000000
         self.last_clock = clock
+        return clock
+    def _handle_status(self, params):
+        clock = self._extend_clock(params['clock'])
+        for cb in self.status_callbacks:
+            cb(clock, params)
         # Check if this is the best round-trip-time seen so far
         sent_time = params['#sent_time']
         if not sent_time:
@@ -78,6 +150,11 @@ class ClockSync:
             self.min_rtt_time = sent_time
             logging.debug("new minimum rtt %.3f: hrtt=%.6f freq=%d",
                           sent_time, half_rtt, self.clock_est[2])
+        # The status interval varies - weight the sample by the time
+        # it covers so that the regression's time constant is fixed
+        sample_time = min(max(sent_time - self.last_sample_time, 0.),
+                          COMM_TIMEOUT)
+        decay = 1. - (1. - DECAY)**sample_time
         # Filter out samples that are extreme outliers
         exp_clock = ((sent_time - self.time_avg) * self.clock_est[2]
                      + self.clock_avg)
@@ -98,19 +175,26 @@ class ClockSync:
         else:
             self.last_prediction_time = sent_time
             self.prediction_variance = (
-                (1. - DECAY) * (self.prediction_variance + clock_diff2 * DECAY))
+                (1. - decay) * (self.prediction_variance + clock_diff2 * decay))
         # Add clock and sent_time to linear regression
+        self.last_sample_time = sent_time
         diff_sent_time = sent_time - self.time_avg
-        self.time_avg += DECAY * diff_sent_time
-        self.time_variance = (1. - DECAY) * (
-            self.time_variance + diff_sent_time**2 * DECAY)
+        self.time_avg += decay * diff_sent_time
+        self.time_variance = (1. - decay) * (
+            self.time_variance + diff_sent_time**2 * decay)
         diff_clock = clock - self.clock_avg
-        self.clock_avg += DECAY * diff_clock
-        self.clock_covariance = (1. - DECAY) * (
-            self.clock_covariance + diff_sent_time * diff_clock * DECAY)
+        self.clock_avg += decay * diff_clock
+        self.clock_covariance = (1. - decay) * (
+            self.clock_covariance + diff_sent_time * diff_clock * decay)
         # Update prediction from linear regression
         new_freq = self.clock_covariance / self.time_variance
         pred_stddev = math.sqrt(self.prediction_variance)
+        # Query more often while the frequency estimate is changing
+        drift = abs(new_freq - self.clock_est[2]) / self.mcu_freq
+        interval = STATUS_MAX_INTERVAL
+        if drift * STATUS_MAX_INTERVAL > STATUS_DRIFT_TARGET:
+            interval = max(STATUS_DRIFT_TARGET / drift, STATUS_MIN_INTERVAL)
+        self.status_interval = interval
         self.serial.set_clock_est(new_freq, self.time_avg + TRANSMIT_EXTRA,
                                   int(self.clock_avg - 3. * pred_stddev))
         self.clock_est = (self.time_avg + self.min_half_rtt,
@@ -146,12 +230,12 @@ class ClockSync:
         return ("clocksync state: mcu_freq=%d last_clock=%d"
                 " clock_est=(%.3f %d %.3f) min_half_rtt=%.6f min_rtt_time=%.3f"
                 " time_avg=%.3f(%.3f) clock_avg=%.3f(%.3f)"
-                " pred_variance=%.3f" % (
+                " pred_variance=%.3f status_interval=%.3f" % (
                     self.mcu_freq, self.last_clock, sample_time, clock, freq,
                     self.min_half_rtt, self.min_rtt_time,
                     self.time_avg, self.time_variance,
                     self.clock_avg, self.clock_covariance,
-                    self.prediction_variance))
+                    self.prediction_variance, self.status_interval))
     def stats(self, eventtime):
         sample_time, clock, freq = self.clock_est
         return "freq=%d" % (freq,)
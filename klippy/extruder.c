@@ -0,0 +1,231 @@
+// Extruder pressure advance and step generation
+//
+// Copyright (C) 2016,2017  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+//
+// This code implements the pressure advance logic of
+// klippy/extruder.py:PrinterExtruder.  The extruder_lookahead()
+// function determines the speed the head will reach after each
+// decelerating move (so that pressure advance is not released for a
+// brief slow down) and extruder_move() generates the extruder steps
+// of a move directly from the planned velocities.
+
+#include <stdint.h> // int32_t
+#include "extruder.h" // extruder_move
+#include "lookahead.h" // struct lookahead_move
+#include "stepcompress.h" // stepcompress_push_const
+
+static inline double
+max2(double a, double b)
+{
+    return a > b ? a : b;
+}
+
+
+/****************************************************************
+ * Pressure advance lookahead
+ ****************************************************************/
+
+// Find the maximum velocity reached within 'lookahead_t' seconds
+// starting at the move at position 'start'.  Returns 1 if the moves
+// ran out before the end of the lookahead window was found.
+static int
+calc_window_v(struct lookahead_move *moves, int start, int flush_count
+              , double lookahead_t, double *max_v)
+{
+    double max_corner_v = 0., sum_t = lookahead_t;
+    int i;
+    for (i=start; i<flush_count; i++) {
+        struct lookahead_move *m = &moves[i];
+        if (!m->max_start_v2) {
+            *max_v = max_corner_v;
+            return 0;
+        }
+        if (m->cruise_v > max_corner_v) {
+            if (!max_corner_v && !m->accel_t && !m->cruise_t)
+                // Start timing after any full decel moves
+                continue;
+            if (sum_t >= m->accel_t)
+                max_corner_v = m->cruise_v;
+            else
+                max_corner_v = max2(max_corner_v
+                                    , m->start_v + m->accel * sum_t);
+        }
+        sum_t -= m->accel_t + m->cruise_t + m->decel_t;
+        if (sum_t <= 0.) {
+            *max_v = max_corner_v;
+            return 0;
+        }
+    }
+    *max_v = max_corner_v;
+    return 1;
+}
+
+// Calculate extrude_max_corner_v - the speed the head will accelerate
+// to after cornering - of all decelerating moves.  The moves are
+// swept from last to first; the window of each move starts at the
+// next move that is not a full deceleration move, so all moves of a
+// deceleration ramp share (and only calculate once) the same window.
+// Returns the number of moves that may be flushed.
+int
+extruder_lookahead(struct lookahead_move *moves, int flush_count, int lazy
+                   , double lookahead_t)
+{
+    int move_count = flush_count, window_start = flush_count;
+    int calc_start = -1, calc_exhausted = 0;
+    double calc_v = 0.;
+    int i;
+    for (i=flush_count-1; i>=0; i--) {
+        struct lookahead_move *m = &moves[i];
+        if (m->decel_t) {
+            if (window_start != calc_start) {
+                calc_start = window_start;
+                calc_exhausted = calc_window_v(moves, window_start, flush_count
+                                               , lookahead_t, &calc_v);
+            }
+            if (calc_exhausted && calc_v < m->cruise_v) {
+                // The head may still accelerate past the end of the queue
+                if (lazy)
+                    move_count = i;
+            }
+            m->extrude_max_corner_v = calc_v;
+        }
+        // Leading full decel moves (without a junction stop) are
+        // skipped when timing the window of the previous move
+        if (!m->max_start_v2 || m->cruise_v <= 0. || m->accel_t
+            || m->cruise_t)
+            window_start = i;
+    }
+    return move_count;
+}
+
+
+/****************************************************************
+ * Extruder step generation
+ ****************************************************************/
+
+// Generate the steps of one segment of an extruder move
+static int32_t
+push_segment(struct stepcompress *sc, double print_time, double *commanded_pos
+             , double inv_step_dist, double start_pos, double dist
+             , double start_v, double accel)
+{
+    double step_offset = *commanded_pos - start_pos * inv_step_dist;
+    int32_t count = stepcompress_push_const(
+        sc, print_time, step_offset, dist * inv_step_dist
+        , start_v * inv_step_dist, accel * inv_step_dist);
+    if (count == ERROR_RET)
+        return ERROR_RET;
+    *commanded_pos += count;
+    return 0;
+}
+
+// Schedule the extruder steps of a move (adjusted for pressure
+// advance).  The stepper's commanded position (in steps) and the
+// extruder position (in mm) are updated to the positions after the
+// move.
+int32_t
+extruder_move(struct stepcompress *sc, struct lookahead_move *m
+              , double print_time, double *commanded_pos, double inv_step_dist
+              , double *extrude_pos, double move_start_pos, double axis_d
+              , double extrude_r, double pressure_advance)
+{
+    double axis_r = (axis_d < 0. ? -axis_d : axis_d) / m->move_d;
+    double accel = m->accel * axis_r;
+    double start_v = m->start_v * axis_r;
+    double cruise_v = m->cruise_v * axis_r;
+    double end_v = m->end_v * axis_r;
+    double accel_t = m->accel_t, cruise_t = m->cruise_t, decel_t = m->decel_t;
+    double accel_d = m->accel_r * axis_d;
+    double cruise_d = m->cruise_r * axis_d;
+    double decel_d = m->decel_r * axis_d;
+
+    double retract_t = 0., retract_d = 0., retract_v = 0.;
+    double decel_v = cruise_v;
+
+    // Update for pressure advance
+    double start_pos = *extrude_pos;
+    if (axis_d >= 0. && (m->axes_d[0] || m->axes_d[1]) && pressure_advance) {
+        // Increase accel_d and start_v when accelerating
+        pressure_advance *= extrude_r;
+        double prev_pressure_d = start_pos - move_start_pos;
+        if (accel_d) {
+            double npd = m->cruise_v * pressure_advance;
+            double extra_accel_d = npd - prev_pressure_d;
+            if (extra_accel_d > 0.) {
+                accel_d += extra_accel_d;
+                start_v += extra_accel_d / accel_t;
+                prev_pressure_d += extra_accel_d;
+            }
+        }
+        // Update decel and retract parameters when decelerating
+        double emcv = m->extrude_max_corner_v;
+        if (decel_d && emcv < m->cruise_v) {
+            double npd = max2(emcv, m->end_v) * pressure_advance;
+            double extra_decel_d = prev_pressure_d - npd;
+            if (extra_decel_d > 0.) {
+                double extra_decel_v = extra_decel_d / decel_t;
+                decel_v -= extra_decel_v;
+                end_v -= extra_decel_v;
+                if (decel_v <= 0.) {
+                    // The entire decel phase is replaced with retraction
+                    retract_t = decel_t;
+                    retract_d = -(end_v + decel_v) * 0.5 * decel_t;
+                    retract_v = -decel_v;
+                    decel_t = decel_d = 0.;
+                } else if (end_v < 0.) {
+                    // Split decel phase into decel and retraction
+                    retract_t = -end_v / accel;
+                    retract_d = -end_v * 0.5 * retract_t;
+                    decel_t -= retract_t;
+                    decel_d = decel_v * 0.5 * decel_t;
+                } else {
+                    // There is still only a decel phase (no retraction)
+                    decel_d -= extra_decel_d;
+                }
+            }
+        }
+    }
+
+    // Generate steps
+    double move_time = print_time;
+    int32_t ret;
+    if (accel_d) {
+        // Acceleration steps
+        ret = push_segment(sc, move_time, commanded_pos, inv_step_dist
+                           , start_pos, accel_d, start_v, accel);
+        if (ret)
+            return ret;
+        start_pos += accel_d;
+        move_time += accel_t;
+    }
+    if (cruise_d) {
+        // Cruising steps
+        ret = push_segment(sc, move_time, commanded_pos, inv_step_dist
+                           , start_pos, cruise_d, cruise_v, 0.);
+        if (ret)
+            return ret;
+        start_pos += cruise_d;
+        move_time += cruise_t;
+    }
+    if (decel_d) {
+        // Deceleration steps
+        ret = push_segment(sc, move_time, commanded_pos, inv_step_dist
+                           , start_pos, decel_d, decel_v, -accel);
+        if (ret)
+            return ret;
+        start_pos += decel_d;
+        move_time += decel_t;
+    }
+    if (retract_d) {
+        // Retraction steps
+        ret = push_segment(sc, move_time, commanded_pos, inv_step_dist
+                           , start_pos, -retract_d, retract_v, accel);
+        if (ret)
+            return ret;
+        start_pos -= retract_d;
+    }
+    *extrude_pos = start_pos;
+    return 0;
+}
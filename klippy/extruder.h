@@ -0,0 +1,15 @@
+#ifndef EXTRUDER_H
+#define EXTRUDER_H
+
+#include <stdint.h> // int32_t
+
+struct lookahead_move;
+struct stepcompress;
+int extruder_lookahead(struct lookahead_move *moves, int flush_count
+    , int lazy, double lookahead_t);
+int32_t extruder_move(struct stepcompress *sc, struct lookahead_move *m
+    , double print_time, double *commanded_pos, double inv_step_dist
+    , double *extrude_pos, double move_start_pos, double axis_d
+    , double extrude_r, double pressure_advance);
+
+#endif // extruder.h
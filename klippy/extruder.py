@@ -4,7 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import math, logging
-import stepper, heater, homing
+import stepper, heater, homing, chelper
 
 EXTRUDE_DIFF_IGNORE = 1.02
 
@@ -45,6 +45,7 @@ class PrinterExtruder:
                 'pressure_advance_lookahead_time', 0.010, minval=0.)
         self.need_motor_enable = True
         self.extrude_pos = 0.
+        ffi_main, self.ffi_lib = chelper.get_ffi()
     def get_heater(self):
         return self.heater
     def set_active(self, print_time, is_active):
@@ -58,7 +59,6 @@ class PrinterExtruder:
         self.need_motor_enable = True
     def check_move(self, move):
         move.extrude_r = move.axes_d[3] / move.move_d
-        move.extrude_max_corner_v = 0.
         if not self.heater.can_extrude:
             raise homing.EndstopError(
                 "Extrude below minimum temp\n"
@@ -100,124 +100,22 @@ class PrinterExtruder:
                 return 0.
             move.extrude_r = prev_move.extrude_r
         return move.max_cruise_v2
-    def lookahead(self, moves, flush_count, lazy):
+    def lookahead(self, lmoves, flush_count, lazy):
         lookahead_t = self.pressure_advance_lookahead_time
         if not lookahead_t:
             return flush_count
         # Calculate max_corner_v - the speed the head will accelerate
-        # to after cornering.
-        for i in range(flush_count):
-            move = moves[i]
-            if not move.decel_t:
-                continue
-            cruise_v = move.cruise_v
-            max_corner_v = 0.
-            sum_t = lookahead_t
-            for j in range(i+1, flush_count):
-                fmove = moves[j]
-                if not fmove.max_start_v2:
-                    break
-                if fmove.cruise_v > max_corner_v:
-                    if (not max_corner_v
-                        and not fmove.accel_t and not fmove.cruise_t):
-                        # Start timing after any full decel moves
-                        continue
-                    if sum_t >= fmove.accel_t:
-                        max_corner_v = fmove.cruise_v
-                    else:
-                        max_corner_v = max(
-                            max_corner_v, fmove.start_v + fmove.accel * sum_t)
-                    if max_corner_v >= cruise_v:
-                        break
-                sum_t -= fmove.accel_t + fmove.cruise_t + fmove.decel_t
-                if sum_t <= 0.:
-                    break
-            else:
-                if lazy:
-                    return i
-            move.extrude_max_corner_v = max_corner_v
-        return flush_count
+        # to after cornering (see klippy/extruder.c).
+        return self.ffi_lib.extruder_lookahead(
+            lmoves, flush_count, lazy, lookahead_t)
     def move(self, print_time, move):
         if self.need_motor_enable:
             self.stepper.motor_enable(print_time, 1)
             self.need_motor_enable = False
-        axis_d = move.axes_d[3]
-        axis_r = abs(axis_d) / move.move_d
-        accel = move.accel * axis_r
-        start_v = move.start_v * axis_r
-        cruise_v = move.cruise_v * axis_r
-        end_v = move.end_v * axis_r
-        accel_t, cruise_t, decel_t = move.accel_t, move.cruise_t, move.decel_t
-        accel_d = move.accel_r * axis_d
-        cruise_d = move.cruise_r * axis_d
-        decel_d = move.decel_r * axis_d
-
-        retract_t = retract_d = retract_v = 0.
-        decel_v = cruise_v
-
-        # Update for pressure advance
-        start_pos = self.extrude_pos
-        if (axis_d >= 0. and (move.axes_d[0] or move.axes_d[1])
-            and self.pressure_advance):
-            # Increase accel_d and start_v when accelerating
-            pressure_advance = self.pressure_advance * move.extrude_r
-            prev_pressure_d = start_pos - move.start_pos[3]
-            if accel_d:
-                npd = move.cruise_v * pressure_advance
-                extra_accel_d = npd - prev_pressure_d
-                if extra_accel_d > 0.:
-                    accel_d += extra_accel_d
-                    start_v += extra_accel_d / accel_t
-                    prev_pressure_d += extra_accel_d
-            # Update decel and retract parameters when decelerating
-            emcv = move.extrude_max_corner_v
-            if decel_d and emcv < move.cruise_v:
-                npd = max(emcv, move.end_v) * pressure_advance
-                extra_decel_d = prev_pressure_d - npd
-                if extra_decel_d > 0.:
-                    extra_decel_v = extra_decel_d / decel_t
-                    decel_v -= extra_decel_v
-                    end_v -= extra_decel_v
-                    if decel_v <= 0.:
-                        # The entire decel phase is replaced with retraction
-                        retract_t = decel_t
-                        retract_d = -(end_v + decel_v) * 0.5 * decel_t
-                        retract_v = -decel_v
-                        decel_t = decel_d = 0.
-                    elif end_v < 0.:
-                        # Split decel phase into decel and retraction
-                        retract_t = -end_v / accel
-                        retract_d = -end_v * 0.5 * retract_t
-                        decel_t -= retract_t
-                        decel_d = decel_v * 0.5 * decel_t
-                    else:
-                        # There is still only a decel phase (no retraction)
-                        decel_d -= extra_decel_d
-
-        # Prepare for steps
-        step_const = self.stepper.step_const
-        move_time = print_time
-
-        # Acceleration steps
-        if accel_d:
-            step_const(move_time, start_pos, accel_d, start_v, accel)
-            start_pos += accel_d
-            move_time += accel_t
-        # Cruising steps
-        if cruise_d:
-            step_const(move_time, start_pos, cruise_d, cruise_v, 0.)
-            start_pos += cruise_d
-            move_time += cruise_t
-        # Deceleration steps
-        if decel_d:
-            step_const(move_time, start_pos, decel_d, decel_v, -accel)
-            start_pos += decel_d
-            move_time += decel_t
-        # Retraction steps
-        if retract_d:
-            step_const(move_time, start_pos, -retract_d, retract_v, accel)
-            start_pos -= retract_d
-        self.extrude_pos = start_pos
+        # Generate steps (with pressure advance) in klippy/extruder.c
+        self.extrude_pos = self.stepper.step_extrude(
+            print_time, move.lmove, self.extrude_pos, move.start_pos[3],
+            move.axes_d[3], move.extrude_r, self.pressure_advance)
 
 # Dummy extruder class used when a printer has no extruder at all
 class DummyExtruder:
@@ -230,7 +128,7 @@ class DummyExtruder:
             move.end_pos, "Extrude when no extruder present")
     def calc_junction(self, prev_move, move):
         return move.max_cruise_v2
-    def lookahead(self, moves, flush_count, lazy):
+    def lookahead(self, lmoves, flush_count, lazy):
         return flush_count
 
 def add_printer_objects(printer, config):
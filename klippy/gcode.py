@@ -3,16 +3,58 @@
 # Copyright (C) 2016,2017  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, re, logging, collections
-import homing, extruder
+import os, re, logging, collections, mmap, stat, errno
+import homing, extruder, chelper
 
 class error(Exception):
     pass
 
+FILE_BLOCK_SIZE = 64 * 1024
+
+# Stream a (debug input) file in large blocks of complete lines
+class GCodeFileReader:
+    def __init__(self, fd, mm):
+        self.fd = fd
+        self.mm = mm
+        self.pos = os.lseek(fd, 0, os.SEEK_CUR)
+    def read_lines(self):
+        # Return the next block of data and its lines (or None at the
+        # end of the file)
+        mm, pos = self.mm, self.pos
+        size = len(mm)
+        if pos >= size:
+            return None
+        end = mm.find('\n', min(pos + FILE_BLOCK_SIZE, size) - 1)
+        if end < 0:
+            end = size
+        else:
+            end += 1
+        data = mm[pos:end]
+        # Keep the file position in sync in case of a restart
+        self.pos = os.lseek(self.fd, end, os.SEEK_SET)
+        lines = data.split('\n')
+        if not lines[-1]:
+            lines.pop()
+        return data, lines
+    def close(self):
+        self.mm.close()
+
+def open_file_reader(fd):
+    # Memory map regular files (other inputs are read via the reactor)
+    try:
+        st = os.fstat(fd)
+        if not stat.S_ISREG(st.st_mode) or not st.st_size:
+            return None
+        return GCodeFileReader(fd, mmap.mmap(fd, 0, access=mmap.ACCESS_READ))
+    except (EnvironmentError, ValueError) as e:
+        logging.info("Unable to map gcode input file: %s", e)
+        return None
+
 # Parse and handle G-Code commands
 class GCodeParser:
     error = error
     RETRY_TIME = 0.100
+    OUTPUT_RETRY_TIME = 0.010
     def __init__(self, printer, fd):
         self.printer = printer
         self.fd = fd
@@ -20,17 +62,24 @@ class GCodeParser:
         self.reactor = printer.reactor
         self.is_processing_data = False
         self.is_fileinput = not not printer.get_start_args().get("debuginput")
-        self.fd_handle = None
+        self.fd_handle = self.file_reader = None
         if not self.is_fileinput:
             self.fd_handle = self.reactor.register_fd(self.fd, self.process_data)
         self.partial_input = ""
         self.bytes_read = 0
         self.input_log = collections.deque([], 50)
+        # Output handling
+        self.output_buffer = []
+        self.flush_pending = False
+        self.flush_timer = self.reactor.register_timer(self.flush_event)
+        self.window = 0
         # Command handling
         self.is_printer_ready = False
         self.base_gcode_handlers = self.gcode_handlers = {}
         self.ready_gcode_handlers = {}
         self.gcode_help = {}
+        self.fast_commands = []
+        self.builtin_handlers = {}
         for cmd in self.all_handlers:
             func = getattr(self, 'cmd_' + cmd)
             wnr = getattr(self, 'cmd_' + cmd + '_when_not_ready', False)
@@ -51,6 +100,22 @@ class GCodeParser:
         self.heaters = []
         self.speed = 25.0
         self.axis2pos = {'X': 0, 'Y': 1, 'Z': 2, 'E': 3}
+        # C parsing of common commands (see klippy/gcodeparse.c)
+        self.ffi_main, self.ffi_lib = ffi_main, ffi_lib = chelper.get_ffi()
+        self.fast_commands = [
+            (ffi_lib.GCODE_G1, ['G0', 'G1'], self.fast_G1),
+            (ffi_lib.GCODE_G92, ['G92'], self.fast_G92),
+            (ffi_lib.GCODE_M82, ['M82'], self.cmd_M82),
+            (ffi_lib.GCODE_M83, ['M83'], self.cmd_M83)]
+        self.builtin_handlers = dict(self.ready_gcode_handlers)
+        self._update_fast_handlers()
+    def _update_fast_handlers(self):
+        # Only use the C parsing for commands that have not been
+        # registered by another module
+        handlers, builtin = self.ready_gcode_handlers, self.builtin_handlers
+        self.fast_handlers = {
+            gtype: (cmds[-1], func) for gtype, cmds, func in self.fast_commands
+            if all(handlers.get(c) is builtin[c] for c in cmds)}
     def register_command(self, cmd, func, when_not_ready=False, desc=None):
         if not (len(cmd) >= 2 and not cmd[0].isupper() and cmd[1].isdigit()):
             origfunc = func
@@ -60,6 +125,10 @@ class GCodeParser:
             self.base_gcode_handlers[cmd] = func
         if desc is not None:
             self.gcode_help[cmd] = desc
+        self._update_fast_handlers()
+    def load_config(self, config):
+        # Number of lines a host may send without waiting for an "ok"
+        self.window = config.getint('gcode_window', 0, minval=0)
     def stats(self, eventtime):
         return "gcodein=%d" % (self.bytes_read,)
     def connect(self):
@@ -74,8 +143,17 @@ class GCodeParser:
         self.heaters = [ e.get_heater() for e in extruders ]
         self.heaters.append(self.printer.objects.get('heater_bed'))
         self.fan = self.printer.objects.get('fan')
-        if self.is_fileinput and self.fd_handle is None:
-            self.fd_handle = self.reactor.register_fd(self.fd, self.process_data)
+        if (self.is_fileinput and self.fd_handle is None
+            and self.file_reader is None):
+            self.file_reader = open_file_reader(self.fd)
+            if self.file_reader is not None:
+                # Blocks are large - only keep the most recent for debugging
+                self.input_log = collections.deque([], 4)
+                self.reactor.register_timer(
+                    self.process_file, self.reactor.NOW)
+            else:
+                self.fd_handle = self.reactor.register_fd(
+                    self.fd, self.process_data)
     def reset_last_position(self):
         if self.toolhead is not None:
             self.last_position = self.toolhead.get_position()
@@ -113,29 +191,53 @@ class GCodeParser:
         logging.info("\n".join(out))
     # Parse input into commands
     args_r = re.compile('([A-Z_]+|[A-Z*])')
+    def fast_parse(self, commands):
+        # Pre-parse the common commands in C
+        if self.gcode_handlers is not self.ready_gcode_handlers:
+            return None
+        glines = self.ffi_main.new('struct gcode_line[]', len(commands))
+        data = '\n'.join(commands)
+        self.ffi_lib.gcode_parse(glines, len(commands), data, len(data))
+        return glines
     def process_commands(self, commands, need_ack=True):
         prev_need_ack = self.need_ack
-        for line in commands:
-            # Ignore comments and leading/trailing spaces
-            line = origline = line.strip()
-            cpos = line.find(';')
-            if cpos >= 0:
-                line = line[:cpos]
-            # Break command into parts
-            parts = self.args_r.split(line.upper())[1:]
-            params = { parts[i]: parts[i+1].strip()
-                       for i in range(0, len(parts), 2) }
-            params['#original'] = origline
-            if parts and parts[0] == 'N':
-                # Skip line number at start of command
-                del parts[:2]
-            if not parts:
-                self.cmd_default(params)
-                continue
-            params['#command'] = cmd = parts[0] + parts[1].strip()
+        glines = self.fast_parse(commands)
+        for lineno, line in enumerate(commands):
+            fast = None
+            if (glines is not None
+                and self.gcode_handlers is not self.ready_gcode_handlers):
+                # A command changed the handlers (eg, a shutdown) - parse
+                # the remaining lines with the regular code
+                glines = None
+            if glines is not None:
+                params = glines[lineno]
+                if params.type == self.ffi_lib.GCODE_EMPTY:
+                    logging.debug(line.strip())
+                    continue
+                fast = self.fast_handlers.get(params.type)
+            if fast is not None:
+                cmd, handler = fast
+            else:
+                # Ignore comments and leading/trailing spaces
+                line = origline = line.strip()
+                cpos = line.find(';')
+                if cpos >= 0:
+                    line = line[:cpos]
+                # Break command into parts
+                parts = self.args_r.split(line.upper())[1:]
+                params = { parts[i]: parts[i+1].strip()
+                           for i in range(0, len(parts), 2) }
+                params['#original'] = origline
+                if parts and parts[0] == 'N':
+                    # Skip line number at start of command
+                    del parts[:2]
+                if not parts:
+                    self.cmd_default(params)
+                    continue
+                params['#command'] = cmd = parts[0] + parts[1].strip()
+                handler = self.gcode_handlers.get(cmd, self.cmd_default)
             # Invoke handler for command
             self.need_ack = need_ack
-            handler = self.gcode_handlers.get(cmd, self.cmd_default)
             try:
                 handler(params)
             except error as e:
@@ -162,30 +264,90 @@ class GCodeParser:
             self.fd_handle = None
             if not self.is_fileinput and lines[0].strip().upper() == 'M112':
                 self.cmd_M112({})
+            self.flush_output()
             while self.is_processing_data:
                 eventtime = self.reactor.pause(eventtime + 0.100)
             self.fd_handle = self.reactor.register_fd(self.fd, self.process_data)
         self.is_processing_data = True
         self.process_commands(lines)
         if not data and self.is_fileinput:
-            self.motor_heater_off()
-            if self.toolhead is not None:
-                self.toolhead.wait_moves()
-            self.printer.request_exit()
+            self.finish_file_input()
         self.is_processing_data = False
+        self.flush_output()
+    def process_file(self, eventtime):
+        # Process a memory mapped input file.  The toolhead pauses
+        # this code (via its stall checks) once enough moves are
+        # buffered, so no additional flow control is needed here.
+        self.is_processing_data = True
+        while 1:
+            block = self.file_reader.read_lines()
+            if block is None:
+                break
+            data, lines = block
+            self.input_log.append((eventtime, data))
+            self.bytes_read += len(data)
+            self.process_commands(lines)
+            # Allow other reactor events to run between blocks
+            eventtime = self.reactor.pause(self.reactor.NOW)
+        self.file_reader.close()
+        self.finish_file_input()
+        self.is_processing_data = False
+        return self.reactor.NEVER
+    def finish_file_input(self):
+        self.motor_heater_off()
+        if self.toolhead is not None:
+            self.toolhead.wait_moves()
+        self.printer.request_exit()
     # Response handling
+    def write_output(self, msg):
+        # Responses generated while processing input are sent together
+        # (in a single write) once the input has been processed.  The
+        # flush timer sends them early if processing pauses (eg, when
+        # the toolhead waits for room in the move queue).
+        self.output_buffer.append(msg)
+        if not self.is_processing_data:
+            self.flush_output()
+        elif not self.flush_pending:
+            self.flush_pending = True
+            self.reactor.update_timer(self.flush_timer, self.reactor.NOW)
+    def flush_event(self, eventtime):
+        self.flush_pending = False
+        self.flush_output()
+        if self.flush_pending:
+            # Output could not be fully written - retry
+            return eventtime + self.OUTPUT_RETRY_TIME
+        return self.reactor.NEVER
+    def flush_output(self):
+        if not self.output_buffer:
+            return
+        data = "".join(self.output_buffer)
+        del self.output_buffer[:]
+        try:
+            count = os.write(self.fd, data)
+        except os.error as e:
+            if e.errno != errno.EAGAIN:
+                raise
+            count = 0
+        if count < len(data):
+            # Host is not reading - retry shortly
+            self.output_buffer.append(data[count:])
+            if not self.flush_pending:
+                self.flush_pending = True
+                self.reactor.update_timer(
+                    self.flush_timer,
+                    self.reactor.monotonic() + self.OUTPUT_RETRY_TIME)
     def ack(self, msg=None):
         if not self.need_ack or self.is_fileinput:
             return
         if msg:
-            os.write(self.fd, "ok %s\n" % (msg,))
+            self.write_output("ok %s\n" % (msg,))
         else:
-            os.write(self.fd, "ok\n")
+            self.write_output("ok\n")
         self.need_ack = False
     def respond(self, msg):
         if self.is_fileinput:
             return
-        os.write(self.fd, msg+"\n")
+        self.write_output(msg+"\n")
     def respond_info(self, msg):
         logging.debug(msg)
         lines = [l.strip() for l in msg.strip().split('\n')]
@@ -251,6 +413,7 @@ class GCodeParser:
         while self.is_printer_ready and heater.check_busy(eventtime):
             print_time = self.toolhead.get_last_move_time()
             self.respond(self.get_temp(eventtime))
+            self.flush_output()
             eventtime = self.reactor.pause(eventtime + 1.)
     def set_temp(self, params, is_bed=False, wait=False):
         temp = self.get_float('S', params, 0.)
@@ -316,45 +479,80 @@ class GCodeParser:
         activate_gcode = self.extruder.get_activate_gcode(True)
         self.process_commands(activate_gcode.split('\n'), need_ack=False)
     all_handlers = [
-        'G1', 'G4', 'G28', 'M18', 'M400',
+        'G1', 'G2', 'G3', 'G4', 'G28', 'M18', 'M400',
         'G20', 'M82', 'M83', 'G90', 'G91', 'G92', 'M206', 'M220', 'M221',
         'M105', 'M104', 'M109', 'M140', 'M190', 'M106', 'M107',
         'M112', 'M114', 'M115', 'IGNORE', 'QUERY_ENDSTOPS', 'PID_TUNE',
         'RESTART', 'FIRMWARE_RESTART', 'ECHO', 'STATUS', 'HELP']
     # G-Code movement commands
-    cmd_G1_aliases = ['G0']
-    def cmd_G1(self, params):
-        # Move
+    def _update_position(self, params):
+        # Update last_position from the axis and speed parameters
+        flags = 0
+        values = [0.] * 5
         try:
-            for axis in 'XYZ':
+            for i, axis in enumerate('XYZEF'):
                 if axis in params:
-                    v = float(params[axis])
-                    pos = self.axis2pos[axis]
-                    if not self.absolutecoord:
-                        # value relative to position of last move
-                        self.last_position[pos] += v
-                    else:
-                        # value relative to base coordinate position
-                        self.last_position[pos] = v + self.base_position[pos]
-            if 'E' in params:
-                v = float(params['E']) * self.extrude_factor
-                if not self.absolutecoord or not self.absoluteextrude:
+                    values[i] = float(params[axis])
+                    flags |= 1 << i
+        except ValueError as e:
+            raise error("Unable to parse move '%s'" % (params['#original'],))
+        if flags & 0x10 and values[4] <= 0.:
+            raise error("Invalid speed in '%s'" % (params['#original'],))
+        self._set_position(flags, values)
+    def _set_position(self, flags, values):
+        for pos in (0, 1, 2):
+            if flags & (1 << pos):
+                v = values[pos]
+                if not self.absolutecoord:
                     # value relative to position of last move
-                    self.last_position[3] += v
+                    self.last_position[pos] += v
                 else:
                     # value relative to base coordinate position
-                    self.last_position[3] = v + self.base_position[3]
-            if 'F' in params:
-                speed = float(params['F']) * self.speed_factor
-                if speed <= 0.:
-                    raise error("Invalid speed in '%s'" % (params['#original'],))
-                self.speed = speed
+                    self.last_position[pos] = v + self.base_position[pos]
+        if flags & 0x08:
+            v = values[3] * self.extrude_factor
+            if not self.absolutecoord or not self.absoluteextrude:
+                # value relative to position of last move
+                self.last_position[3] += v
+            else:
+                # value relative to base coordinate position
+                self.last_position[3] = v + self.base_position[3]
+        if flags & 0x10:
+            self.speed = values[4] * self.speed_factor
+    cmd_G1_aliases = ['G0']
+    def cmd_G1(self, params):
+        # Move
+        self._update_position(params)
+        try:
+            self.toolhead.move(self.last_position, self.speed)
+        except homing.EndstopError as e:
+            raise error(str(e))
+    def fast_G1(self, gline):
+        self._set_position(gline.flags, gline.values)
+        try:
+            self.toolhead.move(self.last_position, self.speed)
+        except homing.EndstopError as e:
+            raise error(str(e))
+    def cmd_G2(self, params, clockwise=True):
+        # Clockwise arc move (in the XY plane)
+        try:
+            offset_i = float(params.get('I', 0.))
+            offset_j = float(params.get('J', 0.))
+            radius = float(params.get('R', 0.))
         except ValueError as e:
             raise error("Unable to parse move '%s'" % (params['#original'],))
+        if not radius and not offset_i and not offset_j:
+            raise error("Arc requires I, J, or R in '%s'" % (
+                params['#original'],))
+        self._update_position(params)
         try:
-            self.toolhead.move(self.last_position, self.speed)
+            self.toolhead.arc_move(self.last_position, offset_i, offset_j,
+                                   radius, clockwise, self.speed)
         except homing.EndstopError as e:
             raise error(str(e))
+    def cmd_G3(self, params):
+        # Counter-clockwise arc move (in the XY plane)
+        self.cmd_G2(params, clockwise=False)
     def cmd_G4(self, params):
         # Dwell
         if 'S' in params:
@@ -407,6 +605,11 @@ class GCodeParser:
         # Set position
         offsets = { p: self.get_float(a, params)
                     for a, p in self.axis2pos.items() if a in params }
+        self._set_origin(offsets)
+    def fast_G92(self, gline):
+        self._set_origin({ p: gline.values[p] for p in (0, 1, 2, 3)
+                           if gline.flags & (1 << p) })
+    def _set_origin(self, offsets):
         for p, offset in offsets.items():
             if p == 3:
                 offset *= self.extrude_factor
@@ -479,6 +682,8 @@ class GCodeParser:
         # Get Firmware Version and Capabilities
         software_version = self.printer.get_start_args().get('software_version')
         kw = {"FIRMWARE_NAME": "Klipper", "FIRMWARE_VERSION": software_version}
+        if self.window:
+            kw["WINDOW"] = self.window
         self.ack(" ".join(["%s:%s" % (k, v) for k, v in kw.items()]))
     cmd_IGNORE_when_not_ready = True
     cmd_IGNORE_aliases = ["G21", "M110", "M21"]
@@ -0,0 +1,195 @@
+// Fast parsing of common G-Code commands
+//
+// Copyright (C) 2017  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+//
+// This code pre-parses a batch of G-Code lines for
+// klippy/gcode.py:GCodeParser.  The most frequent commands (G0, G1,
+// G92, M82, M83, and blank or comment only lines) are recognized and
+// their parameters converted to numbers.  Any line that is not in a
+// simple form that is known to parse identically to the python code
+// (including all lines with parse errors) is reported as
+// GCODE_OTHER, and is then handled by the regular python code.
+
+#include <ctype.h> // isspace
+#include <stdlib.h> // strtod
+#include <string.h> // memchr
+#include "gcodeparse.h" // gcode_parse
+
+// Characters that start a new parameter (matching the python args_r)
+static inline int
+is_key_char(char c)
+{
+    c = toupper((unsigned char)c);
+    return (c >= 'A' && c <= 'Z') || c == '_' || c == '*';
+}
+
+// Strip leading and trailing whitespace from the text at [*p, *end)
+static void
+strip(const char **p, const char **end)
+{
+    const char *s = *p, *e = *end;
+    while (s < e && isspace((unsigned char)*s))
+        s++;
+    while (e > s && isspace((unsigned char)e[-1]))
+        e--;
+    *p = s;
+    *end = e;
+}
+
+// Convert a parameter value.  Only plain decimal numbers are accepted
+// so that the result always matches python's float().
+static int
+parse_value(const char *p, const char *end, double *value)
+{
+    strip(&p, &end);
+    int len = end - p;
+    if (!len || len > 63)
+        return -1;
+    char buf[64];
+    int i;
+    for (i=0; i<len; i++) {
+        char c = p[i];
+        if (!((c >= '0' && c <= '9') || c == '.' || c == '+' || c == '-'))
+            return -1;
+        buf[i] = c;
+    }
+    buf[len] = '\0';
+    char *vend;
+    *value = strtod(buf, &vend);
+    if (vend != &buf[len])
+        return -1;
+    return 0;
+}
+
+// Find the next parameter key at or after 'p'.  The key is returned
+// in [*key, *key_end) and its value in [*key_end, *next).
+static int
+next_param(const char *p, const char *end, const char **key
+           , const char **key_end, const char **next)
+{
+    while (p < end && !is_key_char(*p))
+        p++;
+    if (p >= end)
+        return -1;
+    *key = p;
+    if (*p == '*') {
+        p++;
+    } else {
+        while (p < end && is_key_char(*p) && *p != '*')
+            p++;
+    }
+    *key_end = p;
+    while (p < end && !is_key_char(*p))
+        p++;
+    *next = p;
+    return 0;
+}
+
+// Check if the value at [p, end) is exactly the text 'str'
+static int
+value_is(const char *p, const char *end, const char *str)
+{
+    strip(&p, &end);
+    int len = strlen(str);
+    return end - p == len && !memcmp(p, str, len);
+}
+
+// Determine the command type of a "G" or "M" command
+static int
+parse_command(char letter, const char *p, const char *end)
+{
+    if (letter == 'G') {
+        if (value_is(p, end, "1") || value_is(p, end, "0"))
+            return GCODE_G1;
+        if (value_is(p, end, "92"))
+            return GCODE_G92;
+    } else if (letter == 'M') {
+        if (value_is(p, end, "82"))
+            return GCODE_M82;
+        if (value_is(p, end, "83"))
+            return GCODE_M83;
+    }
+    return GCODE_OTHER;
+}
+
+// Parse a single line (at [p, end)) into 'gl'
+static void
+parse_line(struct gcode_line *gl, const char *p, const char *end)
+{
+    gl->type = GCODE_OTHER;
+    gl->flags = 0;
+    const char *comment = memchr(p, ';', end - p);
+    if (comment)
+        end = comment;
+    strip(&p, &end);
+    if (p >= end) {
+        gl->type = GCODE_EMPTY;
+        return;
+    }
+    if (!is_key_char(*p))
+        return;
+
+    // Find the command (skipping any line number)
+    const char *key, *key_end, *next;
+    next_param(p, end, &key, &key_end, &next);
+    if (key_end - key == 1 && toupper((unsigned char)*key) == 'N') {
+        if (next_param(next, end, &key, &key_end, &next))
+            return;
+    }
+    if (key_end - key != 1)
+        return;
+    int type = parse_command(toupper((unsigned char)*key), key_end, next);
+    if (type == GCODE_OTHER || type == GCODE_M82 || type == GCODE_M83) {
+        gl->type = type;
+        return;
+    }
+
+    // Parse the parameters
+    int flags = 0;
+    while (!next_param(next, end, &key, &key_end, &next)) {
+        if (key_end - key != 1)
+            // Multi-letter parameters are not used by these commands
+            continue;
+        int param;
+        switch (toupper((unsigned char)*key)) {
+        case 'X': param = GP_X; break;
+        case 'Y': param = GP_Y; break;
+        case 'Z': param = GP_Z; break;
+        case 'E': param = GP_E; break;
+        case 'F': param = GP_F; break;
+        default: continue;
+        }
+        if (param == GP_F && type != GCODE_G1)
+            continue;
+        if (parse_value(key_end, next, &gl->values[param]))
+            return;
+        flags |= 1 << param;
+    }
+    if (flags & (1 << GP_F) && gl->values[GP_F] <= 0.)
+        // Let the python code report the invalid speed
+        return;
+    gl->type = type;
+    gl->flags = flags;
+}
+
+// Parse the (newline separated) lines in 'data' into 'lines'.
+// Returns the number of lines parsed.
+int
+gcode_parse(struct gcode_line *lines, int max_lines
+            , const char *data, int len)
+{
+    const char *p = data, *end = data + len;
+    int count = 0;
+    while (count < max_lines) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+        parse_line(&lines[count++], p, eol);
+        if (eol >= end)
+            break;
+        p = eol + 1;
+    }
+    return count;
+}
@@ -0,0 +1,19 @@
+#ifndef GCODEPARSE_H
+#define GCODEPARSE_H
+
+enum {
+    GCODE_OTHER, GCODE_EMPTY, GCODE_G1, GCODE_G92, GCODE_M82, GCODE_M83
+};
+
+// Parameters (in the 'flags' and 'values' of a gcode_line)
+enum { GP_X, GP_Y, GP_Z, GP_E, GP_F, GP_MAX };
+
+struct gcode_line {
+    int type, flags;
+    double values[GP_MAX];
+};
+
+int gcode_parse(struct gcode_line *lines, int max_lines
+    , const char *data, int len);
+
+#endif // gcodeparse.h
@@ -0,0 +1,294 @@
+// Stepper step generation for cartesian, corexy, and delta robots
+//
+// Copyright (C) 2016,2017  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+//
+// This code implements the move() methods of klippy/cartesian.py,
+// klippy/corexy.py, and klippy/delta.py.  The steppers of a robot are
+// registered with a 'kinematics' object and each planned move is then
+// converted to stepper movement and fed to the stepcompress queues
+// of all steppers with a single call.
+
+#include <math.h> // sqrt
+#include <stdlib.h> // malloc
+#include <string.h> // strcmp
+#include "kinematics.h" // kinematics_alloc
+#include "lookahead.h" // struct lookahead_move
+#include "pyhelper.h" // errorf
+#include "stepcompress.h" // stepcompress_push_const
+
+enum { KIN_CARTESIAN, KIN_COREXY, KIN_DELTA };
+
+#define KIN_AXES 3
+
+struct kin_stepper {
+    struct stepcompress *sc;
+    double *commanded_pos, inv_step_dist;
+    int axis;
+};
+
+struct kinematics {
+    int kin_type;
+    struct kin_stepper *steppers;
+    int num_steppers;
+    // Delta tower locations and arm lengths (squared)
+    double towers[KIN_AXES][2], arm2[KIN_AXES];
+};
+
+// Allocate a new 'kinematics' object
+struct kinematics *
+kinematics_alloc(const char *name)
+{
+    int kin_type;
+    if (!strcmp(name, "cartesian")) {
+        kin_type = KIN_CARTESIAN;
+    } else if (!strcmp(name, "corexy")) {
+        kin_type = KIN_COREXY;
+    } else if (!strcmp(name, "delta")) {
+        kin_type = KIN_DELTA;
+    } else {
+        errorf("kinematics_alloc unknown kinematics '%s'", name);
+        return NULL;
+    }
+    struct kinematics *k = malloc(sizeof(*k));
+    memset(k, 0, sizeof(*k));
+    k->kin_type = kin_type;
+    return k;
+}
+
+// Free memory associated with a 'kinematics' object
+void
+kinematics_free(struct kinematics *k)
+{
+    if (!k)
+        return;
+    free(k->steppers);
+    free(k);
+}
+
+// Register a stepper that moves the given axis (or delta tower).  The
+// stepper's commanded position (in steps) is updated in place.
+void
+kinematics_add_stepper(struct kinematics *k, int axis, struct stepcompress *sc
+                       , double *commanded_pos, double inv_step_dist)
+{
+    if (axis < 0 || axis >= KIN_AXES) {
+        errorf("kinematics_add_stepper invalid axis %d", axis);
+        return;
+    }
+    k->steppers = realloc(k->steppers
+                          , (k->num_steppers + 1) * sizeof(*k->steppers));
+    struct kin_stepper *s = &k->steppers[k->num_steppers++];
+    s->sc = sc;
+    s->commanded_pos = commanded_pos;
+    s->inv_step_dist = inv_step_dist;
+    s->axis = axis;
+}
+
+// Set the location and arm length of a delta tower
+void
+kinematics_set_tower(struct kinematics *k, int axis, double x, double y
+                     , double arm2)
+{
+    if (axis < 0 || axis >= KIN_AXES) {
+        errorf("kinematics_set_tower invalid axis %d", axis);
+        return;
+    }
+    k->towers[axis][0] = x;
+    k->towers[axis][1] = y;
+    k->arm2[axis] = arm2;
+}
+
+
+/****************************************************************
+ * Cartesian and corexy
+ ****************************************************************/
+
+// Schedule constant acceleration steps on a stepper
+static int32_t
+push_const(struct kin_stepper *s, double print_time, double start_pos
+           , double dist, double start_v, double accel)
+{
+    double inv_step_dist = s->inv_step_dist;
+    double step_offset = *s->commanded_pos - start_pos * inv_step_dist;
+    int32_t count = stepcompress_push_const(
+        s->sc, print_time, step_offset, dist * inv_step_dist
+        , start_v * inv_step_dist, accel * inv_step_dist);
+    if (count == ERROR_RET)
+        return ERROR_RET;
+    *s->commanded_pos += count;
+    return 0;
+}
+
+// Generate the steps of a stepper that moves linearly with the head
+static int32_t
+linear_move(struct kin_stepper *s, struct lookahead_move *m, double print_time
+            , double start_pos, double axis_d)
+{
+    if (!axis_d)
+        return 0;
+    double move_time = print_time;
+    double axis_r = (axis_d < 0. ? -axis_d : axis_d) / m->move_d;
+    double accel = m->accel * axis_r;
+    double cruise_v = m->cruise_v * axis_r;
+    int32_t ret;
+
+    // Acceleration steps
+    if (m->accel_r) {
+        double accel_d = m->accel_r * axis_d;
+        ret = push_const(s, move_time, start_pos, accel_d
+                         , m->start_v * axis_r, accel);
+        if (ret)
+            return ret;
+        start_pos += accel_d;
+        move_time += m->accel_t;
+    }
+    // Cruising steps
+    if (m->cruise_r) {
+        double cruise_d = m->cruise_r * axis_d;
+        ret = push_const(s, move_time, start_pos, cruise_d, cruise_v, 0.);
+        if (ret)
+            return ret;
+        start_pos += cruise_d;
+        move_time += m->cruise_t;
+    }
+    // Deceleration steps
+    if (m->decel_r) {
+        double decel_d = m->decel_r * axis_d;
+        ret = push_const(s, move_time, start_pos, decel_d, cruise_v, -accel);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+// Generate the steps of a cartesian or corexy stepper
+static int32_t
+cartesian_move(struct kinematics *k, struct kin_stepper *s
+               , struct lookahead_move *m, double print_time)
+{
+    int axis = s->axis;
+    if (k->kin_type == KIN_COREXY && axis < 2) {
+        // The A and B steppers move along the diagonals
+        double sxp = m->start_pos[0], syp = m->start_pos[1];
+        double exp = m->end_pos[0], eyp = m->end_pos[1];
+        double start_pos = axis ? sxp - syp : sxp + syp;
+        double end_pos = axis ? exp - eyp : exp + eyp;
+        return linear_move(s, m, print_time, start_pos, end_pos - start_pos);
+    }
+    return linear_move(s, m, print_time, m->start_pos[axis], m->axes_d[axis]);
+}
+
+
+/****************************************************************
+ * Delta
+ ****************************************************************/
+
+// Schedule steps on a delta tower
+static int32_t
+push_delta(struct kin_stepper *s, double print_time, double dist
+           , double start_v, double accel, double height_base
+           , double startxy_d, double arm_d, double movez_r)
+{
+    double inv_step_dist = s->inv_step_dist;
+    double height = *s->commanded_pos - height_base * inv_step_dist;
+    int32_t count = stepcompress_push_delta(
+        s->sc, print_time, dist * inv_step_dist, start_v * inv_step_dist
+        , accel * inv_step_dist, height, startxy_d * inv_step_dist
+        , arm_d * inv_step_dist, movez_r);
+    if (count == ERROR_RET)
+        return ERROR_RET;
+    *s->commanded_pos += count;
+    return 0;
+}
+
+// Generate the steps of a delta tower
+static int32_t
+delta_move(struct kinematics *k, struct kin_stepper *s
+           , struct lookahead_move *m, double print_time)
+{
+    double *axes_d = m->axes_d, move_d = m->move_d;
+    double movexy_r = 1., movez_r = 0., inv_movexy_d = 1. / move_d;
+    if (!axes_d[0] && !axes_d[1]) {
+        // Z only move
+        movez_r = axes_d[2] * inv_movexy_d;
+        movexy_r = inv_movexy_d = 0.;
+    } else if (axes_d[2]) {
+        // XY+Z move
+        double movexy_d = sqrt(axes_d[0]*axes_d[0] + axes_d[1]*axes_d[1]);
+        movexy_r = movexy_d * inv_movexy_d;
+        movez_r = axes_d[2] * inv_movexy_d;
+        inv_movexy_d = 1. / movexy_d;
+    }
+
+    double accel = m->accel, cruise_v = m->cruise_v;
+    double accel_d = m->accel_r * move_d;
+    double cruise_d = m->cruise_r * move_d;
+    double decel_d = m->decel_r * move_d;
+
+    // Calculate a virtual tower along the line of movement at the
+    // point closest to this stepper's tower.
+    int axis = s->axis;
+    double towerx_d = k->towers[axis][0] - m->start_pos[0];
+    double towery_d = k->towers[axis][1] - m->start_pos[1];
+    double vt_startxy_d = (towerx_d*axes_d[0] + towery_d*axes_d[1])*inv_movexy_d;
+    double tangentxy_d2 = (towerx_d*towerx_d + towery_d*towery_d
+                           - vt_startxy_d*vt_startxy_d);
+    double vt_arm_d = sqrt(k->arm2[axis] - tangentxy_d2);
+    double vt_startz = m->start_pos[2];
+
+    // Generate steps
+    double move_time = print_time;
+    int32_t ret;
+    if (accel_d) {
+        ret = push_delta(s, move_time, accel_d, m->start_v, accel
+                         , vt_startz, vt_startxy_d, vt_arm_d, movez_r);
+        if (ret)
+            return ret;
+        vt_startz += accel_d * movez_r;
+        vt_startxy_d -= accel_d * movexy_r;
+        move_time += m->accel_t;
+    }
+    if (cruise_d) {
+        ret = push_delta(s, move_time, cruise_d, cruise_v, 0.
+                         , vt_startz, vt_startxy_d, vt_arm_d, movez_r);
+        if (ret)
+            return ret;
+        vt_startz += cruise_d * movez_r;
+        vt_startxy_d -= cruise_d * movexy_r;
+        move_time += m->cruise_t;
+    }
+    if (decel_d) {
+        ret = push_delta(s, move_time, decel_d, cruise_v, -accel
+                         , vt_startz, vt_startxy_d, vt_arm_d, movez_r);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+
+/****************************************************************
+ * Move dispatch
+ ****************************************************************/
+
+// Generate the steps of all registered steppers for a planned move.
+// Returns 0 on success or ERROR_RET on an internal error.
+int32_t
+kinematics_move(struct kinematics *k, struct lookahead_move *m
+                , double print_time)
+{
+    int i;
+    for (i=0; i<k->num_steppers; i++) {
+        struct kin_stepper *s = &k->steppers[i];
+        int32_t ret;
+        if (k->kin_type == KIN_DELTA)
+            ret = delta_move(k, s, m, print_time);
+        else
+            ret = cartesian_move(k, s, m, print_time);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef KINEMATICS_H
+#define KINEMATICS_H
+
+#include <stdint.h> // int32_t
+
+struct lookahead_move;
+struct stepcompress;
+struct kinematics *kinematics_alloc(const char *name);
+void kinematics_free(struct kinematics *k);
+void kinematics_add_stepper(struct kinematics *k, int axis
+    , struct stepcompress *sc, double *commanded_pos, double inv_step_dist);
+void kinematics_set_tower(struct kinematics *k, int axis, double x, double y
+    , double arm2);
+int32_t kinematics_move(struct kinematics *k, struct lookahead_move *m
+    , double print_time);
+
+#endif // kinematics.h
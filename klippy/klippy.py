@@ -173,6 +173,7 @@ class Printer:
         config = ConfigWrapper(self, 'printer')
         for m in [pins, mcu, chipmisc, toolhead, extruder, heater, fan]:
             m.add_printer_objects(self, config)
+        self.gcode.load_config(config)
         self.mcus = mcu.get_printer_mcus(self)
         # Validate that there are no undefined parameters in the config file
         valid_sections = { s: 1 for s, o in self.all_config_options }
@@ -325,6 +326,7 @@ def main():
     while 1:
         printer = Printer(input_fd, bglogger, start_args)
         res = printer.run()
+        printer.reactor.finalize()
         if res == 'exit':
             break
         time.sleep(1.)
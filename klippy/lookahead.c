@@ -0,0 +1,276 @@
+// Move queue look-ahead planning
+//
+// Copyright (C) 2016,2017  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+//
+// This code implements the junction speed and "look-ahead" logic of
+// klippy/toolhead.py:MoveQueue.  The moves are stored in a contiguous
+// array and each flush determines the start, cruise, and end velocity
+// (and the resulting acceleration, cruise, and deceleration phases)
+// of all moves that can be finalized.  The python code then reads the
+// results from the array in bulk.
+//
+// A lazy flush only succeeds once the queue contains a velocity peak
+// that the moves before it can not be affected by.  Until then each
+// lazy flush would walk the entire queue again.  To avoid that, the
+// state of the backward pass on entry to each move is recorded, and a
+// later lazy flush stops as soon as it reaches a move with the same
+// entry state - the remainder of the walk would produce the same
+// result (no flush point) as before.  Once moves are limited by their
+// junction speeds (rather than by the distance to the end of the
+// queue) their entry state no longer changes as moves are appended,
+// so each lazy flush only visits the recently added moves.
+
+#include <math.h> // sqrt
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "lookahead.h" // struct lookahead_move
+#include "pyhelper.h" // errorf
+
+struct lookahead {
+    double junction_deviation;
+    struct lookahead_move *moves;
+    int count, size, leftover;
+    // Scratch storage for moves awaiting the next peak cruise velocity
+    struct delayed_move { int pos; double start_v2, end_v2; } *delayed;
+    // Backward pass state on entry to each move during the last lazy
+    // flush that found nothing to flush (indexed like 'moves')
+    struct pass_state { double end_v2, smoothed_v2; int flags; } *pass;
+};
+
+// Allocate a new 'lookahead' object
+struct lookahead *
+lookahead_alloc(double junction_deviation)
+{
+    struct lookahead *la = malloc(sizeof(*la));
+    memset(la, 0, sizeof(*la));
+    la->junction_deviation = junction_deviation;
+    return la;
+}
+
+// Free memory associated with a 'lookahead' object
+void
+lookahead_free(struct lookahead *la)
+{
+    if (!la)
+        return;
+    free(la->moves);
+    free(la->delayed);
+    free(la->pass);
+    free(la);
+}
+
+// Remove all pending moves
+void
+lookahead_reset(struct lookahead *la)
+{
+    la->count = la->leftover = 0;
+}
+
+// Return the array of pending moves (valid until the next add or pop)
+struct lookahead_move *
+lookahead_get_moves(struct lookahead *la)
+{
+    return la->moves;
+}
+
+static inline double
+min2(double a, double b)
+{
+    return a < b ? a : b;
+}
+
+// Determine the maximum velocity at the junction of two moves using
+// the approximated centripetal velocity as described at:
+// https://onehossshay.wordpress.com/2011/09/24/improving_grbl_cornering_algorithm/
+static void
+calc_junction(struct lookahead *la, struct lookahead_move *m
+              , struct lookahead_move *prev, double extruder_v2)
+{
+    if (!m->is_kinematic_move || !prev->is_kinematic_move)
+        return;
+    double junction_cos_theta = -((m->axes_d[0] * prev->axes_d[0]
+                                   + m->axes_d[1] * prev->axes_d[1]
+                                   + m->axes_d[2] * prev->axes_d[2])
+                                  / (m->move_d * prev->move_d));
+    if (junction_cos_theta > 0.999999)
+        return;
+    if (junction_cos_theta < -0.999999)
+        junction_cos_theta = -0.999999;
+    double sin_theta_d2 = sqrt(0.5*(1.0-junction_cos_theta));
+    double R = la->junction_deviation * sin_theta_d2 / (1. - sin_theta_d2);
+    double max_start_v2 = min2(R * m->accel, R * prev->accel);
+    max_start_v2 = min2(max_start_v2, extruder_v2);
+    max_start_v2 = min2(max_start_v2, m->max_cruise_v2);
+    max_start_v2 = min2(max_start_v2, prev->max_cruise_v2);
+    max_start_v2 = min2(max_start_v2, prev->max_start_v2 + prev->delta_v2);
+    m->max_start_v2 = max_start_v2;
+    m->max_smoothed_v2 = min2(
+        max_start_v2, prev->max_smoothed_v2 + prev->smooth_delta_v2);
+}
+
+// Add a move to the end of the queue (the move's speed limits must
+// already be final).  Returns the move's maximum junction velocity
+// squared.
+double
+lookahead_add_move(struct lookahead *la, double start_x, double start_y
+                   , double start_z, double end_x, double end_y, double end_z
+                   , double move_d, int is_kinematic_move, double accel
+                   , double max_cruise_v2, double delta_v2
+                   , double smooth_delta_v2, double extruder_v2)
+{
+    if (la->count >= la->size) {
+        int size = la->size ? la->size * 2 : 1024;
+        la->moves = realloc(la->moves, size * sizeof(*la->moves));
+        la->delayed = realloc(la->delayed, size * sizeof(*la->delayed));
+        la->pass = realloc(la->pass, size * sizeof(*la->pass));
+        la->size = size;
+    }
+    la->pass[la->count].flags = 0;
+    struct lookahead_move *m = &la->moves[la->count++];
+    memset(m, 0, sizeof(*m));
+    m->start_pos[0] = start_x;
+    m->start_pos[1] = start_y;
+    m->start_pos[2] = start_z;
+    m->end_pos[0] = end_x;
+    m->end_pos[1] = end_y;
+    m->end_pos[2] = end_z;
+    m->axes_d[0] = end_x - start_x;
+    m->axes_d[1] = end_y - start_y;
+    m->axes_d[2] = end_z - start_z;
+    m->move_d = move_d;
+    m->is_kinematic_move = is_kinematic_move;
+    m->accel = accel;
+    m->max_cruise_v2 = max_cruise_v2;
+    m->delta_v2 = delta_v2;
+    m->smooth_delta_v2 = smooth_delta_v2;
+    if (la->count > 1)
+        calc_junction(la, m, m - 1, extruder_v2);
+    return m->max_start_v2;
+}
+
+// Determine the accel, cruise, and decel portions of a move
+static void
+set_junction(struct lookahead_move *m
+             , double start_v2, double cruise_v2, double end_v2)
+{
+    double inv_delta_v2 = 1. / m->delta_v2;
+    double accel_r = m->accel_r = (cruise_v2 - start_v2) * inv_delta_v2;
+    double decel_r = m->decel_r = (cruise_v2 - end_v2) * inv_delta_v2;
+    double cruise_r = m->cruise_r = 1. - accel_r - decel_r;
+    // Determine move velocities
+    double start_v = m->start_v = sqrt(start_v2);
+    double cruise_v = m->cruise_v = sqrt(cruise_v2);
+    double end_v = m->end_v = sqrt(end_v2);
+    // Determine time spent in each portion of move (time is the
+    // distance divided by average velocity)
+    m->accel_t = accel_r * m->move_d / ((start_v + cruise_v) * 0.5);
+    m->cruise_t = cruise_r * m->move_d / cruise_v;
+    m->decel_t = decel_r * m->move_d / ((end_v + cruise_v) * 0.5);
+}
+
+enum { PF_VALID = 1<<0, PF_PEAK = 1<<1, PF_DELAYED = 1<<2 };
+
+// Traverse the queue from last to first move and determine the
+// maximum junction speeds assuming the robot comes to a complete stop
+// after the last move.  Returns the number of moves that have their
+// velocities set (and may be flushed), or -1 if a lazy flush found
+// no moves that could be flushed.
+int
+lookahead_flush(struct lookahead *la, int lazy)
+{
+    struct lookahead_move *moves = la->moves;
+    struct delayed_move *delayed = la->delayed;
+    struct pass_state *pass = la->pass;
+    int update_flush_count = lazy, flush_count = la->count, num_delayed = 0;
+    double next_end_v2 = 0., next_smoothed_v2 = 0., peak_cruise_v2 = 0.;
+    int i;
+    for (i=la->count-1; i>=la->leftover; i--) {
+        struct lookahead_move *m = &moves[i];
+        if (update_flush_count) {
+            // Only the velocities and whether a peak or delayed moves
+            // are pending can influence the search for a flush point
+            int flags = (PF_VALID | (peak_cruise_v2 ? PF_PEAK : 0)
+                         | (num_delayed ? PF_DELAYED : 0));
+            struct pass_state *ps = &pass[i];
+            if (ps->flags == flags && ps->end_v2 == next_end_v2
+                && ps->smoothed_v2 == next_smoothed_v2)
+                // Same state as a previous walk that found no flush point
+                return -1;
+            ps->flags = flags;
+            ps->end_v2 = next_end_v2;
+            ps->smoothed_v2 = next_smoothed_v2;
+        }
+        double reachable_start_v2 = next_end_v2 + m->delta_v2;
+        double start_v2 = min2(m->max_start_v2, reachable_start_v2);
+        double reachable_smoothed_v2 = next_smoothed_v2 + m->smooth_delta_v2;
+        double smoothed_v2 = min2(m->max_smoothed_v2, reachable_smoothed_v2);
+        if (smoothed_v2 < reachable_smoothed_v2) {
+            // It's possible for this move to accelerate
+            if (smoothed_v2 + m->smooth_delta_v2 > next_smoothed_v2
+                || num_delayed) {
+                // This move can decelerate or this is a full accel
+                // move after a full decel move
+                if (update_flush_count && peak_cruise_v2) {
+                    flush_count = i;
+                    update_flush_count = 0;
+                }
+                peak_cruise_v2 = min2(m->max_cruise_v2, (
+                    smoothed_v2 + reachable_smoothed_v2) * .5);
+                if (num_delayed) {
+                    // Propagate peak_cruise_v2 to any delayed moves
+                    if (!update_flush_count && i < flush_count) {
+                        int j;
+                        for (j=0; j<num_delayed; j++) {
+                            struct delayed_move *d = &delayed[j];
+                            double mc_v2 = min2(peak_cruise_v2, d->start_v2);
+                            set_junction(&moves[d->pos]
+                                         , min2(d->start_v2, mc_v2), mc_v2
+                                         , min2(d->end_v2, mc_v2));
+                        }
+                    }
+                    num_delayed = 0;
+                }
+            }
+            if (!update_flush_count && i < flush_count) {
+                double cruise_v2 = min2((start_v2 + reachable_start_v2) * .5
+                                        , m->max_cruise_v2);
+                cruise_v2 = min2(cruise_v2, peak_cruise_v2);
+                set_junction(m, min2(start_v2, cruise_v2), cruise_v2
+                             , min2(next_end_v2, cruise_v2));
+            }
+        } else {
+            // Delay calculating this move until peak_cruise_v2 is known
+            struct delayed_move *d = &delayed[num_delayed++];
+            d->pos = i;
+            d->start_v2 = start_v2;
+            d->end_v2 = next_end_v2;
+        }
+        next_end_v2 = start_v2;
+        next_smoothed_v2 = smoothed_v2;
+    }
+    if (update_flush_count)
+        return -1;
+    // The recorded state of the moves that remain queued described a
+    // walk that did not find this flush point - discard it
+    for (i=flush_count; i<la->count; i++)
+        pass[i].flags = 0;
+    return flush_count;
+}
+
+// Remove moves that have been processed.  The moves between
+// 'move_count' and 'flush_count' keep their velocities.
+void
+lookahead_pop(struct lookahead *la, int move_count, int flush_count)
+{
+    if (move_count > la->count || flush_count < move_count) {
+        errorf("lookahead_pop invalid count %d %d %d"
+               , move_count, flush_count, la->count);
+        return;
+    }
+    la->count -= move_count;
+    memmove(la->moves, &la->moves[move_count], la->count * sizeof(*la->moves));
+    memmove(la->pass, &la->pass[move_count], la->count * sizeof(*la->pass));
+    la->leftover = flush_count - move_count;
+}
@@ -0,0 +1,30 @@
+#ifndef LOOKAHEAD_H
+#define LOOKAHEAD_H
+
+struct lookahead_move {
+    // Move parameters (set by lookahead_add_move)
+    double start_pos[3], end_pos[3], axes_d[3], move_d;
+    int is_kinematic_move;
+    double accel, max_cruise_v2, delta_v2, smooth_delta_v2;
+    double max_start_v2, max_smoothed_v2;
+    // Planned velocities (set by lookahead_flush)
+    double accel_r, cruise_r, decel_r;
+    double start_v, cruise_v, end_v;
+    double accel_t, cruise_t, decel_t;
+    // Extruder pressure advance limit (set by extruder_lookahead)
+    double extrude_max_corner_v;
+};
+
+struct lookahead *lookahead_alloc(double junction_deviation);
+void lookahead_free(struct lookahead *la);
+void lookahead_reset(struct lookahead *la);
+struct lookahead_move *lookahead_get_moves(struct lookahead *la);
+double lookahead_add_move(struct lookahead *la, double start_x, double start_y
+    , double start_z, double end_x, double end_y, double end_z
+    , double move_d, int is_kinematic_move, double accel
+    , double max_cruise_v2, double delta_v2, double smooth_delta_v2
+    , double extruder_v2);
+int lookahead_flush(struct lookahead *la, int lazy);
+void lookahead_pop(struct lookahead *la, int move_count, int flush_count);
+
+#endif // lookahead.h
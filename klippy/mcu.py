@@ -3,13 +3,18 @@
 # Copyright (C) 2016,2017  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import sys, os, zlib, logging, math
-import serialhdl, pins, chelper, clocksync
+import sys, os, zlib, logging, math, struct
+import serialhdl, msgproto, pins, chelper, clocksync, util
 
 class error(Exception):
     pass
 
 STEPCOMPRESS_ERROR_RET = -989898989
+# Maximum amount of config image data sent in each config_image_write
+CONFIG_IMAGE_CHUNK = 48
+# Time to reserve move queue items the mcu reports in use beyond the
+# local estimate (the interval between clocksync status reports)
+MOVE_STATUS_HOLD = 1.000
 
 class MCU_stepper:
     def __init__(self, mcu, pin_params):
@@ -18,11 +23,16 @@ class MCU_stepper:
         self._step_pin = pin_params['pin']
         self._invert_step = pin_params['invert']
         self._dir_pin = self._invert_dir = None
-        self._commanded_pos = self._mcu_position_offset = 0.
+        self._mcu_position_offset = 0.
         self._step_dist = self._inv_step_dist = 1.
         self._min_stop_interval = 0.
         self._reset_cmd = self._get_position_cmd = None
-        self._ffi_lib = self._stepqueue = None
+        self._stepqueue = None
+        self._kinematics = []
+        # The commanded position (in steps) is also updated by C code
+        ffi_main, self._ffi_lib = chelper.get_ffi()
+        self._commanded_pos = ffi_main.new('double[1]')
+        self._extrude_pos = ffi_main.new('double[1]')
     def get_mcu(self):
         return self._mcu
     def setup_dir_pin(self, pin_params):
@@ -35,6 +45,9 @@ class MCU_stepper:
     def setup_step_distance(self, step_dist):
         self._step_dist = step_dist
         self._inv_step_dist = 1. / step_dist
+    def setup_kinematics(self, kin, axis):
+        # Register with a C kinematics object (see klippy/kinematics.c)
+        self._kinematics.append((kin, axis))
     def build_config(self):
         max_error = self._mcu.get_max_stepper_error()
         min_stop_interval = max(0., self._min_stop_interval - max_error)
@@ -60,18 +73,22 @@ class MCU_stepper:
             self._invert_dir, self._oid),
                                       self._ffi_lib.stepcompress_free)
         self._mcu.register_stepqueue(self._stepqueue)
+        for kin, axis in self._kinematics:
+            self._ffi_lib.kinematics_add_stepper(
+                kin, axis, self._stepqueue, self._commanded_pos,
+                self._inv_step_dist)
     def get_oid(self):
         return self._oid
     def get_step_dist(self):
         return self._step_dist
     def set_position(self, pos):
         steppos = pos * self._inv_step_dist
-        self._mcu_position_offset += self._commanded_pos - steppos
-        self._commanded_pos = steppos
+        self._mcu_position_offset += self._commanded_pos[0] - steppos
+        self._commanded_pos[0] = steppos
     def get_commanded_position(self):
-        return self._commanded_pos * self._step_dist
+        return self._commanded_pos[0] * self._step_dist
     def get_mcu_position(self):
-        mcu_pos = self._commanded_pos + self._mcu_position_offset
+        mcu_pos = self._commanded_pos[0] + self._mcu_position_offset
         if mcu_pos >= 0.:
             return int(mcu_pos + 0.5)
         return int(mcu_pos - 0.5)
@@ -99,33 +116,26 @@ class MCU_stepper:
         pos = params['pos']
         if self._invert_dir:
             pos = -pos
-        self._mcu_position_offset = pos - self._commanded_pos
+        self._mcu_position_offset = pos - self._commanded_pos[0]
     def step(self, print_time, sdir):
         count = self._ffi_lib.stepcompress_push(
             self._stepqueue, print_time, sdir)
         if count == STEPCOMPRESS_ERROR_RET:
             raise error("Internal error in stepcompress")
-        self._commanded_pos += count
-    def step_const(self, print_time, start_pos, dist, start_v, accel):
-        inv_step_dist = self._inv_step_dist
-        step_offset = self._commanded_pos - start_pos * inv_step_dist
-        count = self._ffi_lib.stepcompress_push_const(
-            self._stepqueue, print_time, step_offset, dist * inv_step_dist,
-            start_v * inv_step_dist, accel * inv_step_dist)
-        if count == STEPCOMPRESS_ERROR_RET:
-            raise error("Internal error in stepcompress")
-        self._commanded_pos += count
-    def step_delta(self, print_time, dist, start_v, accel
-                   , height_base, startxy_d, arm_d, movez_r):
-        inv_step_dist = self._inv_step_dist
-        height = self._commanded_pos - height_base * inv_step_dist
-        count = self._ffi_lib.stepcompress_push_delta(
-            self._stepqueue, print_time, dist * inv_step_dist,
-            start_v * inv_step_dist, accel * inv_step_dist,
-            height, startxy_d * inv_step_dist, arm_d * inv_step_dist, movez_r)
-        if count == STEPCOMPRESS_ERROR_RET:
+        self._commanded_pos[0] += count
+    def step_extrude(self, print_time, lmove, extrude_pos, move_start_pos
+                     , axis_d, extrude_r, pressure_advance):
+        # Schedule an extruder move (see klippy/extruder.c) - returns
+        # the extruder position after the move
+        pos = self._extrude_pos
+        pos[0] = extrude_pos
+        ret = self._ffi_lib.extruder_move(
+            self._stepqueue, lmove, print_time, self._commanded_pos,
+            self._inv_step_dist, pos, move_start_pos, axis_d, extrude_r,
+            pressure_advance)
+        if ret:
             raise error("Internal error in stepcompress")
-        self._commanded_pos += count
+        return pos[0]
 
 class MCU_endstop:
     class TimeoutError(Exception):
@@ -142,6 +152,7 @@ class MCU_endstop:
         self._homing = False
         self._min_query_time = self._next_query_time = 0.
         self._last_state = {}
+        self._state_completion = None
     def get_mcu(self):
         return self._mcu
     def add_stepper(self, stepper):
@@ -181,12 +192,34 @@ class MCU_endstop:
         for s in self._steppers:
             s.note_homing_start(clock)
     def home_wait(self, home_end_time):
-        eventtime = self._mcu.monotonic()
-        while self._check_busy(eventtime, home_end_time):
-            eventtime = self._mcu.pause(eventtime + 0.1)
+        self._wait_state(home_end_time)
     def _handle_end_stop_state(self, params):
+        # Called from the serial background thread
         logging.debug("end_stop_state %s", params)
         self._last_state = params
+        completion = self._state_completion
+        if completion is not None:
+            self._mcu.async_complete(completion, params)
+    def _wait_state(self, home_end_time=0.):
+        # Wait for end_stop_state responses until no longer busy.  The
+        # completion is created before checking the state so that a
+        # response arriving during the check is not missed.
+        try:
+            while 1:
+                self._state_completion = completion = self._mcu.completion()
+                eventtime = self._mcu.monotonic()
+                if not self._check_busy(eventtime, home_end_time):
+                    break
+                if self._homing:
+                    # Query again as soon as the homing move should be
+                    # complete (so that a timeout is detected promptly)
+                    print_time = self._mcu.estimated_print_time(eventtime)
+                    end_time = eventtime + home_end_time - print_time
+                    if eventtime < end_time < self._next_query_time:
+                        self._next_query_time = end_time
+                completion.wait(self._next_query_time)
+        finally:
+            self._state_completion = None
     def _check_busy(self, eventtime, home_end_time=0.):
         # Check if need to send an end_stop_query command
         last_sent_time = self._last_state.get('#sent_time', -1.)
@@ -218,9 +251,7 @@ class MCU_endstop:
         self._homing = False
         self._min_query_time = self._next_query_time = self._mcu.monotonic()
     def query_endstop_wait(self):
-        eventtime = self._mcu.monotonic()
-        while self._check_busy(eventtime):
-            eventtime = self._mcu.pause(eventtime + 0.1)
+        self._wait_state()
         return self._last_state.get('pin', self._invert) ^ self._invert
 
 class MCU_digital_out:
@@ -416,10 +447,12 @@ class MCU:
         self._serialport = config.get('serial', '/dev/ttyS0')
         baud = 0
         if not (self._serialport.startswith("/dev/rpmsg_")
-                or self._serialport.startswith("/tmp/klipper_host_")):
+                or self._serialport.startswith("/tmp/klipper_host_")
+                or self._serialport.startswith("shm:")):
             baud = config.getint('baud', 250000, minval=2400)
+        self._cache_dir = config.get('dictionary_cache', '~/.cache/klipper')
         self._serial = serialhdl.SerialReader(
-            printer.reactor, self._serialport, baud)
+            printer.reactor, self._serialport, baud, self._cache_dir)
         # Restarts
         self._restart_method = 'command'
         if baud:
@@ -439,6 +472,8 @@ class MCU:
         self._init_cmds = []
         self._config_cmds = []
         self._config_crc = None
+        self._config_image = ""
+        self._persist_config = config.getboolean('persist_config', False)
         self._pin_map = config.get('pin_map', None)
         self._custom = config.get('custom', '')
         self._mcu_freq = 0.
@@ -448,11 +483,16 @@ class MCU:
             'max_stepper_error', 0.000025, minval=0.)
         self._stepqueues = []
         self._steppersync = None
+        self._move_count = self._move_free = 0
+        self._move_status = None
+        self._move_seq_start = 0
         # Stats
         self._stats_sumsq_base = 0.
         self._mcu_tick_avg = 0.
         self._mcu_tick_stddev = 0.
         self._mcu_tick_awake = 0.
+        self._stats_hist_shift = 0
+        self._mcu_hists = {}
     # Serial callbacks
     def handle_mcu_stats(self, params):
         count = params['count']
@@ -462,6 +502,35 @@ class MCU:
         tick_sumsq = params['sumsq'] * self._stats_sumsq_base
         self._mcu_tick_stddev = c * math.sqrt(count*tick_sumsq - tick_sum**2)
         self._mcu_tick_awake = tick_sum / self._mcu_freq
+    def handle_mcu_stats_hist(self, params):
+        # Decode histogram (bucket i holds values below 1<<(shift+i) ticks)
+        data = str(params['hist'])
+        counts = list(struct.unpack('>%dI' % (len(data) // 4,), data))
+        total = sum(counts)
+        limit = 0
+        if total:
+            # Upper bound on the 99th percentile
+            accum = 0
+            for i, count in enumerate(counts):
+                accum += count
+                if accum >= .99 * total:
+                    limit = 1 << (self._stats_hist_shift + i)
+                    if i == len(counts) - 1:
+                        limit = params['max']
+                    break
+        name = ['timer_late', 'loop'][params['type']]
+        self._mcu_hists[name] = (params['max'] / self._mcu_freq,
+                                 limit / self._mcu_freq)
+        logging.debug("MCU '%s' %s histogram: %s", self._name, name, counts)
+    def handle_move_status(self, clock, params):
+        if 'move_clock' in params:
+            if self._steppersync is None:
+                # Note the mcu allocation count before any moves are sent
+                self._move_seq_start = params['move_seq']
+            done_clock = clock - ((params['clock'] - params['move_clock'])
+                                  & 0xffffffff)
+            self._move_status = (clock, done_clock, params['move_free'],
+                                 params['move_seq'])
     def handle_shutdown(self, params):
         if self._is_shutdown:
             return
@@ -534,13 +603,87 @@ class MCU:
         # Calculate config CRC
         self._config_crc = zlib.crc32('\n'.join(self._config_cmds)) & 0xffffffff
         self.add_config_cmd("finalize_config crc=%d" % (self._config_crc,))
+        self._config_image = self._compile_config()
+    def _compile_config(self):
+        # Encode the config commands into a binary image (each command
+        # is prefixed by its length).  The image is cached as parsing
+        # each command is slow.
+        msgparser = self._serial.msgparser
+        cache_file = None
+        if self._cache_dir:
+            dict_crc = zlib.crc32(msgparser.raw_identify_data) & 0xffffffff
+            cache_file = os.path.join(
+                os.path.expanduser(self._cache_dir),
+                "config-%08x-%08x" % (dict_crc, self._config_crc))
+            data = util.read_cache_file(cache_file)
+            if data is not None and len(data) >= 4:
+                image, crc = data[:-4], struct.unpack('<I', data[-4:])[0]
+                if zlib.crc32(image) & 0xffffffff == crc:
+                    return image
+        out = []
+        for c in self._config_cmds:
+            cmd = msgparser.create_command(c)
+            out.append(chr(len(cmd)) + "".join(map(chr, cmd)))
+        image = "".join(out)
+        if cache_file is not None:
+            util.write_cache_file(cache_file, image + struct.pack(
+                '<I', zlib.crc32(image) & 0xffffffff))
+        return image
+    def _send_config_image(self):
+        image = self._config_image
+        pos = 0
+        while pos < len(image):
+            cmdlen = ord(image[pos])
+            self.send(map(ord, image[pos+1:pos+1+cmdlen]))
+            pos += 1 + cmdlen
+    def _update_config_image(self, image_params, store):
+        # Store (or remove) the config image held by the mcu
+        if store:
+            if (image_params['is_valid']
+                and image_params['config_crc'] == self._config_crc):
+                return
+            image = self._config_image
+            if len(image) > image_params['max_size']:
+                logging.info("MCU '%s' config image (%d bytes) is too large"
+                             " to store", self._name, len(image))
+                return
+            write_cmd = self.lookup_command(
+                "config_image_write offset=%hu data=%*s")
+            for pos in range(0, len(image), CONFIG_IMAGE_CHUNK):
+                self.send(write_cmd.encode(
+                    pos, image[pos:pos + CONFIG_IMAGE_CHUNK]))
+            crc = msgproto.crc16_ccitt(image)
+            crc = (ord(crc[0]) << 8) | ord(crc[1])
+        else:
+            if not image_params['is_valid']:
+                return
+            image = ""
+            crc = 0
+        commit_cmd = self.lookup_command(
+            "config_image_commit size=%hu crc=%hu config_crc=%u")
+        params = self.send_with_response(commit_cmd.encode(
+            len(image), crc, self._config_crc), 'config_image')
+        if not store:
+            logging.info("Removed MCU '%s' stored config image", self._name)
+        elif not params['is_valid']:
+            raise error("Unable to store config image on MCU '%s'" % (
+                self._name,))
+        else:
+            logging.info("Stored MCU '%s' config image (%d bytes)",
+                         self._name, len(image))
     def _send_config(self):
         msg = self.create_command("get_config")
+        image_params = None
         if self.is_fileoutput():
             config_params = {
                 'is_config': 0, 'move_count': 500, 'crc': self._config_crc}
         else:
             config_params = self.send_with_response(msg, 'config')
+            image_query = self.try_lookup_command("config_image_query")
+            if image_query is not None:
+                image_params = self.send_with_response(
+                    image_query.encode(), 'config_image')
+        is_image = image_params is not None and image_params['is_applied']
         if not config_params['is_config']:
             if self._restart_method == 'rpi_usb':
                 # Only configure mcu after usb power reset
@@ -548,8 +691,7 @@ class MCU:
             # Send config commands
             logging.info("Sending MCU '%s' printer configuration...",
                          self._name)
-            for c in self._config_cmds:
-                self.send(self.create_command(c))
+            self._send_config_image()
             if not self.is_fileoutput():
                 config_params = self.send_with_response(msg, 'config')
                 if not config_params['is_config']:
@@ -557,19 +699,30 @@ class MCU:
                         raise error("MCU '%s' error during config: %s" % (
                             self._name, self._shutdown_msg))
                     raise error("Unable to configure MCU '%s'" % (self._name,))
+        elif is_image:
+            logging.info("MCU '%s' config restored from its stored image",
+                         self._name)
         else:
             start_reason = self._printer.get_start_args().get("start_reason")
             if start_reason == 'firmware_restart':
                 raise error("Failed automated reset of MCU '%s'" % (self._name,))
         if self._config_crc != config_params['crc']:
+            if is_image:
+                # Remove the stale image so the restart clears the config
+                self._update_config_image(image_params, False)
             self._check_restart("CRC mismatch")
             raise error("MCU '%s' CRC does not match config" % (self._name,))
+        if image_params is not None:
+            self._update_config_image(image_params, self._persist_config)
         move_count = config_params['move_count']
-        logging.info("Configured MCU '%s' (%d moves)", self._name, move_count)
+        move_size = self._serial.msgparser.config.get('STEPPER_MOVE_SIZE', 0)
+        logging.info("Configured MCU '%s' (%d moves, %s bytes per move)",
+                     self._name, move_count, move_size)
         if self._printer.bglogger is not None:
             msgparser = self._serial.msgparser
             info = [
-                "Configured MCU '%s' (%d moves)" % (self._name, move_count),
+                "Configured MCU '%s' (%d moves, %s bytes per move)" % (
+                    self._name, move_count, move_size),
                 "Loaded MCU '%s' %d commands (%s / %s)" % (
                     self._name, len(msgparser.messages_by_id),
                     msgparser.version, msgparser.build_versions),
@@ -579,7 +732,10 @@ class MCU:
         self._steppersync = self._ffi_lib.steppersync_alloc(
             self._serial.serialqueue, self._stepqueues, len(self._stepqueues),
             move_count)
+        self._move_count = move_count
         self._ffi_lib.steppersync_set_time(self._steppersync, 0., self._mcu_freq)
+        self._ffi_lib.steppersync_set_move_seq(self._steppersync,
+                                               self._move_seq_start)
         for c in self._init_cmds:
             self.send(self.create_command(c))
     def connect(self):
@@ -591,15 +747,19 @@ class MCU:
                 # Try toggling usb power
                 self._check_restart("enable power")
             self._serial.connect()
+            self._clocksync.register_status_callback(self.handle_move_status)
             self._clocksync.connect(self._serial)
         self._mcu_freq = self.get_constant_float('CLOCK_FREQ')
         self._stats_sumsq_base = self.get_constant_float('STATS_SUMSQ_BASE')
+        self._stats_hist_shift = int(self._serial.msgparser.config.get(
+            'STATS_HIST_SHIFT', 0))
         self._emergency_stop_cmd = self.lookup_command("emergency_stop")
         self._reset_cmd = self.try_lookup_command("reset")
         self._config_reset_cmd = self.try_lookup_command("config_reset")
         self.register_msg(self.handle_shutdown, 'shutdown')
         self.register_msg(self.handle_shutdown, 'is_shutdown')
         self.register_msg(self.handle_mcu_stats, 'stats')
+        self.register_msg(self.handle_mcu_stats_hist, 'stats_hist')
         self._build_config()
         self._send_config()
     # Config creation helpers
@@ -666,6 +826,10 @@ class MCU:
         return self._printer.reactor.pause(waketime)
     def monotonic(self):
         return self._printer.reactor.monotonic()
+    def completion(self):
+        return self._printer.reactor.completion()
+    def async_complete(self, completion, result):
+        self._printer.reactor.async_complete(completion, result)
     # Restarts
     def _restart_arduino(self):
         logging.info("Attempting MCU '%s' reset", self._name)
@@ -714,6 +878,15 @@ class MCU:
         clock = self.print_time_to_clock(print_time)
         if clock < 0:
             return
+        move_status = self._move_status
+        if move_status is not None:
+            # Apply mcu reported move queue usage
+            self._move_status = None
+            status_clock, done_clock, move_free, move_seq = move_status
+            hold_clock = status_clock + self.seconds_to_clock(MOVE_STATUS_HOLD)
+            self._ffi_lib.steppersync_note_move_status(
+                self._steppersync, done_clock, move_free, move_seq, hold_clock)
+            self._move_free = move_free
         ret = self._ffi_lib.steppersync_flush(self._steppersync, clock)
         if ret:
             raise error("Internal error in MCU '%s' stepcompress" % (
@@ -735,6 +908,11 @@ class MCU:
         msg = "%s: mcu_awake=%.03f mcu_task_avg=%.06f mcu_task_stddev=%.06f" % (
             self._name, self._mcu_tick_awake, self._mcu_tick_avg,
             self._mcu_tick_stddev)
+        for name, (max_time, limit_time) in sorted(self._mcu_hists.items()):
+            msg += " mcu_%s_max=%.06f mcu_%s_99=%.06f" % (
+                name, max_time, name, limit_time)
+        if self._move_count:
+            msg += " mcu_move_free=%d/%d" % (self._move_free, self._move_count)
         return ' '.join([msg, self._serial.stats(eventtime),
                          self._clocksync.stats(eventtime)])
     def do_shutdown(self, force=False):
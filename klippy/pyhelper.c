@@ -9,6 +9,7 @@
 #include <stdint.h> // uint8_t
 #include <stdio.h> // fprintf
 #include <string.h> // strerror
+#include <sys/timerfd.h> // timerfd_create
 #include <time.h> // struct timespec
 #include "pyhelper.h" // get_monotonic
 
@@ -33,6 +34,41 @@ fill_time(double time)
     return (struct timespec) {t, (time - t)*1000000000. };
 }
 
+// Create a timerfd (using the monotonic clock) for reactor wakeups
+int
+reactor_timerfd_create(void)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+        report_errno("timerfd_create", fd);
+    return fd;
+}
+
+// Arm a timerfd to expire at an absolute monotonic time (or disarm it
+// if 'waketime' is not positive)
+int
+reactor_timerfd_set(int fd, double waketime)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (waketime > 0.) {
+        // Round up so that get_monotonic() is never before 'waketime'
+        // once the timer expires
+        time_t t = waketime;
+        long nsec = (waketime - t) * 1000000000. + 1.;
+        if (nsec >= 1000000000) {
+            t++;
+            nsec -= 1000000000;
+        }
+        its.it_value.tv_sec = t;
+        its.it_value.tv_nsec = nsec;
+    }
+    int ret = timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL);
+    if (ret)
+        report_errno("timerfd_settime", ret);
+    return ret;
+}
+
 static void
 default_logger(const char *msg)
 {
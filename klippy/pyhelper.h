@@ -6,6 +6,8 @@
 
 double get_monotonic(void);
 struct timespec fill_time(double time);
+int reactor_timerfd_create(void);
+int reactor_timerfd_set(int fd, double waketime);
 void set_python_logging_callback(void (*func)(const char *));
 void errorf(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 void report_errno(char *where, int rc);
@@ -3,14 +3,17 @@
 # Copyright (C) 2016,2017  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import select, math, time
+import sys, os, select, math, time, heapq, collections
 import greenlet
-import chelper
+import chelper, util
 
 class ReactorTimer:
     def __init__(self, callback, waketime):
         self.callback = callback
         self.waketime = waketime
+        # Sequence number of the timer's valid heap entry (0 if the
+        # timer has no heap entry, -1 if the timer is unregistered)
+        self.heap_seq = 0
 
 class ReactorFileHandler:
     def __init__(self, fd, callback):
@@ -24,52 +27,125 @@ class ReactorGreenlet(greenlet.greenlet):
         greenlet.greenlet.__init__(self, run=run)
         self.timer = None
 
+# Wait for a result that is provided by another part of the code
+class ReactorCompletion:
+    class sentinel: pass
+    def __init__(self, reactor):
+        self.reactor = reactor
+        self.result = self.sentinel
+        self.waiting = []
+    def test(self):
+        return self.result is not self.sentinel
+    def complete(self, result):
+        if self.result is not self.sentinel:
+            return
+        self.result = result
+        for g in self.waiting:
+            timer = getattr(g, 'timer', None)
+            if timer is not None:
+                self.reactor.update_timer(timer, self.reactor.NOW)
+    def wait(self, waketime, waketime_result=None):
+        # Wait until complete() is called (or until 'waketime')
+        if self.result is self.sentinel:
+            g = greenlet.getcurrent()
+            self.waiting.append(g)
+            self.reactor.pause(waketime)
+            self.waiting.remove(g)
+            if self.result is self.sentinel:
+                return waketime_result
+        return self.result
+
 class SelectReactor:
     NOW = 0.
     NEVER = 9999999999999999.
     def __init__(self):
         self._fds = []
-        self._timers = []
+        # Timers are stored in a heap of (waketime, seq, timer) entries.
+        # Updating or unregistering a timer does not remove its old
+        # entry - instead, entries that don't match the timer's
+        # heap_seq are discarded when they reach the top of the heap.
+        self._timer_heap = []
+        self._timer_count = 0
+        self._timer_seq = 0
+        self._timer_time = self.NOW
         self._next_timer = self.NEVER
         self._process = False
         self._g_dispatch = None
         self._greenlets = []
         self.monotonic = chelper.get_ffi()[1].get_monotonic
+        # Completions signaled from other threads
+        self._async_queue = collections.deque()
+        self._pipe_fds = os.pipe()
+        util.set_nonblock(self._pipe_fds[0])
+        util.set_nonblock(self._pipe_fds[1])
+        self._async_handler = None
     # Timers
-    def _note_time(self, t):
-        nexttime = t.waketime
-        if nexttime < self._next_timer:
-            self._next_timer = nexttime
+    def _schedule_timer(self, t, waketime):
+        t.waketime = waketime
+        if t.heap_seq < 0:
+            # Timer is not registered
+            return
+        if waketime >= self.NEVER:
+            t.heap_seq = 0
+            return
+        heap = self._timer_heap
+        if len(heap) > 2 * self._timer_count + 16:
+            # Discard stale entries
+            heap[:] = [e for e in heap if e[1] == e[2].heap_seq]
+            heapq.heapify(heap)
+        self._timer_seq += 1
+        t.heap_seq = seq = self._timer_seq
+        # Entries that are already due are ordered after the timers
+        # that were due at the start of the current timer pass
+        heapq.heappush(heap, (max(waketime, self._timer_time), seq, t))
+        if waketime < self._next_timer:
+            self._next_timer = waketime
     def update_timer(self, t, nexttime):
-        t.waketime = nexttime
-        self._note_time(t)
+        self._schedule_timer(t, nexttime)
     def register_timer(self, callback, waketime = NEVER):
         handler = ReactorTimer(callback, waketime)
-        timers = list(self._timers)
-        timers.append(handler)
-        self._timers = timers
-        self._note_time(handler)
+        self._timer_count += 1
+        self._schedule_timer(handler, waketime)
         return handler
     def unregister_timer(self, handler):
-        timers = list(self._timers)
-        timers.pop(timers.index(handler))
-        self._timers = timers
+        if handler.heap_seq >= 0:
+            handler.heap_seq = -1
+            self._timer_count -= 1
+    def _run_timers(self, eventtime):
+        # Invoke all due timers and return the time of the next timer
+        if eventtime < self._next_timer:
+            return self._next_timer
+        self._timer_time = eventtime
+        last_seq = self._timer_seq
+        heap = self._timer_heap
+        g_dispatch = self._g_dispatch
+        while heap:
+            waketime, seq, t = heap[0]
+            if seq != t.heap_seq:
+                heapq.heappop(heap)
+                continue
+            if waketime > eventtime or seq > last_seq:
+                # Timers rescheduled during this pass run on the next pass
+                break
+            heapq.heappop(heap)
+            t.heap_seq = 0
+            t.waketime = self.NEVER
+            self._schedule_timer(t, t.callback(eventtime))
+            if g_dispatch is not self._g_dispatch:
+                self._end_greenlet(g_dispatch)
+                return self.NOW
+        self._next_timer = self.NEVER
+        if heap:
+            self._next_timer = heap[0][0]
+        return self._next_timer
     def _check_timers(self, eventtime):
+        # Invoke all due timers and return the timeout until the next
         if eventtime < self._next_timer:
             return min(1., max(.001, self._next_timer - eventtime))
-        self._next_timer = self.NEVER
-        g_dispatch = self._g_dispatch
-        for t in self._timers:
-            if eventtime >= t.waketime:
-                t.waketime = self.NEVER
-                t.waketime = t.callback(eventtime)
-                if g_dispatch is not self._g_dispatch:
-                    self._end_greenlet(g_dispatch)
-                    return 0.
-            self._note_time(t)
-        if eventtime >= self._next_timer:
+        waketime = self._run_timers(eventtime)
+        if eventtime >= waketime:
             return 0.
-        return min(1., max(.001, self._next_timer - self.monotonic()))
+        return min(1., max(.001, waketime - self.monotonic()))
     # Greenlets
     def _sys_pause(self, waketime):
         # Pause using system sleep for when reactor not running
@@ -118,12 +194,36 @@ class SelectReactor:
                     eventtime = self.monotonic()
                     break
         self._g_dispatch = None
+    # Completions
+    def completion(self):
+        return ReactorCompletion(self)
+    def async_complete(self, completion, result):
+        # Complete a completion from a thread other than the reactor
+        self._async_queue.append((completion, result))
+        try:
+            os.write(self._pipe_fds[1], '.')
+        except os.error:
+            pass
+    def _got_pipe_signal(self, eventtime):
+        try:
+            os.read(self._pipe_fds[0], 4096)
+        except os.error:
+            pass
+        while self._async_queue:
+            completion, result = self._async_queue.popleft()
+            completion.complete(result)
     def run(self):
+        if self._async_handler is None:
+            self._async_handler = self.register_fd(
+                self._pipe_fds[0], self._got_pipe_signal)
         self._process = True
         g_next = ReactorGreenlet(run=self._dispatch_loop)
         g_next.switch()
     def end(self):
         self._process = False
+    def finalize(self):
+        os.close(self._pipe_fds[0])
+        os.close(self._pipe_fds[1])
 
 class PollReactor(SelectReactor):
     def __init__(self):
@@ -164,6 +264,9 @@ class EPollReactor(SelectReactor):
         SelectReactor.__init__(self)
         self._epoll = select.epoll()
         self._fds = {}
+    def finalize(self):
+        SelectReactor.finalize(self)
+        self._epoll.close()
     # File descriptors
     def register_fd(self, fd, callback):
         handler = ReactorFileHandler(fd, callback)
@@ -193,9 +296,61 @@ class EPollReactor(SelectReactor):
                     break
         self._g_dispatch = None
 
-# Use the poll based reactor if it is available
-try:
-    select.poll
-    Reactor = PollReactor
-except:
-    Reactor = SelectReactor
+# Reactor that sleeps until the exact time of the next timer (the
+# poll() and epoll() timeouts above have millisecond granularity)
+class TimerFDReactor(EPollReactor):
+    def __init__(self):
+        EPollReactor.__init__(self)
+        self._ffi_lib = chelper.get_ffi()[1]
+        self._timerfd = self._ffi_lib.reactor_timerfd_create()
+        if self._timerfd < 0:
+            raise OSError("Unable to create timerfd")
+        self._timerfd_time = None
+        self.register_fd(self._timerfd, self._timerfd_event)
+    def finalize(self):
+        EPollReactor.finalize(self)
+        os.close(self._timerfd)
+    def _set_timerfd(self, waketime):
+        if waketime == self._timerfd_time:
+            return
+        self._timerfd_time = waketime
+        if waketime >= self.NEVER:
+            waketime = 0.
+        self._ffi_lib.reactor_timerfd_set(self._timerfd, waketime)
+    def _timerfd_event(self, eventtime):
+        try:
+            os.read(self._timerfd, 8)
+        except os.error:
+            pass
+        self._timerfd_time = None
+    # Main loop
+    def _dispatch_loop(self):
+        self._g_dispatch = g_dispatch = greenlet.getcurrent()
+        eventtime = self.monotonic()
+        while self._process:
+            waketime = self._run_timers(eventtime)
+            timeout = 0.
+            if waketime > eventtime:
+                # The timerfd provides the wakeup for the next timer
+                self._set_timerfd(waketime)
+                timeout = 1.
+            res = self._epoll.poll(timeout)
+            eventtime = self.monotonic()
+            for fd, event in res:
+                self._fds[fd](eventtime)
+                if g_dispatch is not self._g_dispatch:
+                    self._end_greenlet(g_dispatch)
+                    eventtime = self.monotonic()
+                    break
+        self._g_dispatch = None
+
+# Use the timerfd based reactor on Linux and otherwise the poll based
+# reactor if it is available
+if sys.platform.startswith('linux'):
+    Reactor = TimerFDReactor
+else:
+    try:
+        select.poll
+        Reactor = PollReactor
+    except:
+        Reactor = SelectReactor
@@ -3,7 +3,7 @@
 # Copyright (C) 2016,2017  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging, threading
+import logging, threading, os, struct, zlib
 import serial
 
 import msgproto, chelper, util
@@ -13,10 +13,11 @@ class error(Exception):
 
 class SerialReader:
     BITS_PER_BYTE = 10.
-    def __init__(self, reactor, serialport, baud):
+    def __init__(self, reactor, serialport, baud, dict_cache_dir=None):
         self.reactor = reactor
         self.serialport = serialport
         self.baud = baud
+        self.dict_cache_dir = dict_cache_dir
         # Serial port
         self.ser = None
         self.msgparser = msgproto.MessageParser()
@@ -56,24 +57,34 @@ class SerialReader:
         logging.info("Starting serial connect")
         while 1:
             starttime = self.reactor.monotonic()
-            try:
+            if self.serialport.startswith('shm:'):
+                # Local mcu process using a shared memory transport
+                self.serialqueue = self.ffi_lib.serialqueue_alloc_shm(
+                    self.serialport[4:])
+                if self.serialqueue == self.ffi_main.NULL:
+                    logging.warn("Unable to open shared memory transport")
+                    self.serialqueue = None
+                    self.reactor.pause(starttime + 5.)
+                    continue
+            else:
+                try:
+                    if self.baud:
+                        self.ser = serial.Serial(
+                            self.serialport, self.baud, timeout=0)
+                    else:
+                        self.ser = open(self.serialport, 'rb+')
+                except (OSError, IOError, serial.SerialException) as e:
+                    logging.warn("Unable to open port: %s", e)
+                    self.reactor.pause(starttime + 5.)
+                    continue
                 if self.baud:
-                    self.ser = serial.Serial(
-                        self.serialport, self.baud, timeout=0)
-                else:
-                    self.ser = open(self.serialport, 'rb+')
-            except (OSError, IOError, serial.SerialException) as e:
-                logging.warn("Unable to open port: %s", e)
-                self.reactor.pause(starttime + 5.)
-                continue
-            if self.baud:
-                stk500v2_leave(self.ser, self.reactor)
-            self.serialqueue = self.ffi_lib.serialqueue_alloc(
-                self.ser.fileno(), 0)
+                    stk500v2_leave(self.ser, self.reactor)
+                self.serialqueue = self.ffi_lib.serialqueue_alloc(
+                    self.ser.fileno(), 0)
             self.background_thread = threading.Thread(target=self._bg_thread)
             self.background_thread.start()
             # Obtain and load the data dictionary from the firmware
-            sbs = SerialBootStrap(self)
+            sbs = SerialBootStrap(self, self.dict_cache_dir)
             identify_data = sbs.get_identify_data(starttime + 5.)
             if identify_data is None:
                 logging.warn("Timeout on serial connect")
@@ -184,7 +195,7 @@ class SerialRetryCommand:
         self.cmd = cmd
         self.name = name
         self.oid = oid
-        self.response = None
+        self.completion = serial.reactor.completion()
         self.min_query_time = self.serial.reactor.monotonic()
         self.serial.register_callback(self.handle_callback, self.name, self.oid)
         self.send_timer = self.serial.reactor.register_timer(
@@ -193,62 +204,175 @@ class SerialRetryCommand:
         self.serial.unregister_callback(self.name, self.oid)
         self.serial.reactor.unregister_timer(self.send_timer)
     def send_event(self, eventtime):
-        if self.response is not None:
+        if self.completion.test():
             return self.serial.reactor.NEVER
         self.serial.send(self.cmd)
         return eventtime + self.RETRY_TIME
     def handle_callback(self, params):
+        # Called from the background thread
         last_sent_time = params['#sent_time']
         if last_sent_time >= self.min_query_time:
-            self.response = params
+            self.serial.reactor.async_complete(self.completion, params)
     def get_response(self):
-        eventtime = self.serial.reactor.monotonic()
-        while self.response is None:
-            eventtime = self.serial.reactor.pause(eventtime + 0.05)
-            if eventtime > self.min_query_time + self.TIMEOUT_TIME:
-                self.unregister()
-                raise error("Timeout on wait for '%s' response" % (self.name,))
+        params = self.completion.wait(self.min_query_time + self.TIMEOUT_TIME)
         self.unregister()
-        return self.response
+        if params is None:
+            raise error("Timeout on wait for '%s' response" % (self.name,))
+        return params
 
 # Code to start communication and download message type dictionary
 class SerialBootStrap:
     RETRY_TIME = 0.500
-    def __init__(self, serial):
+    RESEND_TIME = 0.050
+    CHUNK_SIZE = 48
+    MAX_PENDING = 4
+    HASH_OFFSET = 0xffffffff
+    DOWNLOAD_RETRIES = 3
+    def __init__(self, serial, cache_dir=None):
         self.serial = serial
-        self.identify_data = ""
+        self.reactor = serial.reactor
+        self.cache_dir = cache_dir
         self.identify_cmd = self.serial.msgparser.lookup_command(
             "identify offset=%u count=%c")
-        self.is_done = False
+        # Outstanding requests (shared with the background thread)
+        self.lock = threading.Lock()
+        self.requests = []
+        self.sent = {}
+        self.send_seq = 0
+        self.window = self.MAX_PENDING
+        self.is_responding = False
+        self.last_progress = 0.
+        self.responses = {}
+        self.completion = None
         self.serial.register_callback(self.handle_identify, 'identify_response')
         self.serial.register_callback(self.handle_unknown, '#unknown')
-        self.send_timer = self.serial.reactor.register_timer(
-            self.send_event, self.serial.reactor.NOW)
+        self.send_timer = self.reactor.register_timer(self.send_event)
     def get_identify_data(self, timeout):
-        eventtime = self.serial.reactor.monotonic()
-        while not self.is_done and eventtime <= timeout:
-            eventtime = self.serial.reactor.pause(eventtime + 0.05)
-        self.serial.unregister_callback('identify_response')
-        self.serial.reactor.unregister_timer(self.send_timer)
-        if not self.is_done:
+        try:
+            return self._get_identify_data(timeout)
+        finally:
+            self.serial.unregister_callback('identify_response')
+            self.reactor.unregister_timer(self.send_timer)
+    def _get_identify_data(self, timeout):
+        # Query the size and crc32 of the data dictionary
+        res = self._fetch([(self.HASH_OFFSET, 8)], timeout)
+        if res is None:
+            return None
+        ihash = res[self.HASH_OFFSET]
+        if len(ihash) != 8:
+            # Firmware can not report its identity - download in blocks
+            return self._download_unknown_size(timeout)
+        size, crc = struct.unpack('<II', ihash)
+        cache_file = None
+        if self.cache_dir:
+            cache_file = os.path.join(os.path.expanduser(self.cache_dir)
+                                      , "dict-%08x-%d" % (crc, size))
+            data = self._load_cache(cache_file, size, crc)
+            if data is not None:
+                logging.info("Loaded data dictionary from %s", cache_file)
+                return data
+        offsets = range(0, size, self.CHUNK_SIZE)
+        for i in range(self.DOWNLOAD_RETRIES):
+            res = self._fetch([(o, self.CHUNK_SIZE) for o in offsets], timeout)
+            if res is None:
+                return None
+            data = "".join([res[o] for o in offsets])
+            if len(data) == size and zlib.crc32(data) & 0xffffffff == crc:
+                break
+            logging.warn("Data dictionary does not match its identify hash"
+                         " (got size=%d crc=%08x, expected size=%d crc=%08x)",
+                         len(data), zlib.crc32(data) & 0xffffffff, size, crc)
+        else:
+            raise msgproto.error(
+                "Unable to download a valid data dictionary from the mcu")
+        if cache_file is not None:
+            util.write_cache_file(cache_file, data)
+        return data
+    def _download_unknown_size(self, timeout):
+        data = ""
+        while 1:
+            offsets = [len(data) + i * self.CHUNK_SIZE
+                       for i in range(self.MAX_PENDING)]
+            res = self._fetch([(o, self.CHUNK_SIZE) for o in offsets], timeout)
+            if res is None:
+                return None
+            for o in offsets:
+                data += res[o]
+                if len(res[o]) < self.CHUNK_SIZE:
+                    return data
+    def _load_cache(self, cache_file, size, crc):
+        data = util.read_cache_file(cache_file)
+        if data is None:
+            return None
+        if len(data) != size or zlib.crc32(data) & 0xffffffff != crc:
+            logging.warn("Ignoring invalid data dictionary cache %s",
+                         cache_file)
             return None
-        return self.identify_data
+        return data
+    # Request the given (offset, count) blocks and wait for all of them
+    def _fetch(self, requests, timeout):
+        completion = self.reactor.completion()
+        with self.lock:
+            self.requests = list(requests)
+            self.sent = {}
+            self.responses = {}
+            self.completion = completion
+            self.last_progress = self.reactor.monotonic()
+            self._send_requests()
+        self.reactor.update_timer(self.send_timer, self.reactor.NOW)
+        res = completion.wait(timeout)
+        self.reactor.update_timer(self.send_timer, self.reactor.NEVER)
+        with self.lock:
+            self.completion = None
+            if res is None:
+                return None
+            return self.responses
+    def _send_requests(self):
+        # Keep up to 'window' requests in flight (lock must be held)
+        for offset, count in self.requests[:self.window]:
+            if offset not in self.sent:
+                self.send_seq += 1
+                self.sent[offset] = self.send_seq
+                self.serial.send(self.identify_cmd.encode(offset, count))
     def handle_identify(self, params):
-        if self.is_done or params['offset'] != len(self.identify_data):
-            return
-        msgdata = params['data']
-        if not msgdata:
-            self.is_done = True
-            return
-        self.identify_data += msgdata
-        imsg = self.identify_cmd.encode(len(self.identify_data), 40)
-        self.serial.send(imsg)
+        offset = params['offset']
+        with self.lock:
+            if (self.completion is None or offset not in self.sent
+                or offset in self.responses):
+                return
+            self.responses[offset] = params['data']
+            self.is_responding = True
+            self.last_progress = self.reactor.monotonic()
+            # The mcu responds in order - any earlier request was lost
+            # (small mcu transmit buffers may drop responses).
+            seq = self.sent[offset]
+            lost = [o for o, c in self.requests
+                    if o in self.sent and self.sent[o] < seq]
+            if lost:
+                self.window = max(1, self.window // 2)
+                for o in lost:
+                    del self.sent[o]
+            self.requests = [r for r in self.requests if r[0] != offset]
+            if self.requests:
+                self._send_requests()
+                return
+            completion = self.completion
+        self.reactor.async_complete(completion, True)
     def send_event(self, eventtime):
-        if self.is_done:
-            return self.serial.reactor.NEVER
-        imsg = self.identify_cmd.encode(len(self.identify_data), 40)
-        self.serial.send(imsg)
-        return eventtime + self.RETRY_TIME
+        # Resend any requests that may have been lost
+        with self.lock:
+            retry_time = self.RETRY_TIME
+            if self.is_responding:
+                retry_time = self.RESEND_TIME
+            waketime = self.last_progress + retry_time
+            if eventtime < waketime:
+                return waketime
+            if self.is_responding:
+                self.window = max(1, self.window // 2)
+            self.sent = {}
+            self._send_requests()
+            self.last_progress = eventtime
+        return eventtime + retry_time
     def handle_unknown(self, params):
         logging.debug("Unknown message %d (len %d) while identifying",
                       params['#msgid'], len(params['#msg']))
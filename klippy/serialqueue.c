@@ -12,6 +12,7 @@
 // clock times, prioritizes commands, and handles retransmissions.  A
 // background thread is launched to do this work and minimize latency.
 
+#include <errno.h> // errno
 #include <fcntl.h> // fcntl
 #include <math.h> // ceil
 #include <poll.h> // poll
@@ -21,11 +22,13 @@
 #include <stdio.h> // snprintf
 #include <stdlib.h> // malloc
 #include <string.h> // memset
+#include <sys/mman.h> // shm_open
 #include <termios.h> // tcflush
 #include <unistd.h> // pipe
 #include "list.h" // list_add_tail
 #include "pyhelper.h" // get_monotonic
 #include "serialqueue.h" // struct queue_message
+#include "shmring.h" // shm_ring_read
 
 
 /****************************************************************
@@ -340,6 +343,52 @@ message_queue_free(struct list_head *root)
 }
 
 
+/****************************************************************
+ * Shared memory transport
+ ****************************************************************/
+
+// When the mcu is a local process (see src/linux/console.c) messages
+// may be exchanged via byte rings in a shared memory segment instead
+// of a pseudo-tty.  The ring layout and accessors are in shmring.h.
+
+// Open a doorbell fifo created by the mcu
+static int
+shm_open_doorbell(const char *name, const char *suffix)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "/tmp%s.%s", name, suffix);
+    int fd = open(path, O_RDWR|O_NONBLOCK|O_CLOEXEC);
+    if (fd < 0)
+        report_errno("open doorbell", fd);
+    return fd;
+}
+
+// Map the shared memory segment created by the mcu
+static struct shm_console *
+shm_console_map(const char *name)
+{
+    int fd = shm_open(name, O_RDWR|O_CLOEXEC, 0);
+    if (fd < 0) {
+        report_errno("shm_open", fd);
+        return NULL;
+    }
+    struct shm_console *shm = mmap(NULL, sizeof(*shm), PROT_READ|PROT_WRITE
+                                   , MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        report_errno("mmap", -1);
+        return NULL;
+    }
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC
+        || shm->ring_size != SHM_RING_SIZE) {
+        errorf("Shared memory segment %s has invalid layout", name);
+        munmap(shm, sizeof(*shm));
+        return NULL;
+    }
+    return shm;
+}
+
+
 /****************************************************************
  * Serialqueue interface
  ****************************************************************/
@@ -349,6 +398,8 @@ struct serialqueue {
     struct pollreactor pr;
     int serial_fd;
     int pipe_fds[2];
+    struct shm_console *shm;
+    int shm_wake_mcu_fd;
     uint8_t input_buf[4096];
     uint8_t need_sync;
     int input_pos;
@@ -526,12 +577,30 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
     }
 }
 
+// Write data to the serial port (or shared memory ring)
+static int
+serial_write(struct serialqueue *sq, uint8_t *buf, int len)
+{
+    if (sq->shm)
+        return shm_ring_write(&sq->shm->to_mcu, sq->shm_wake_mcu_fd, buf, len);
+    return write(sq->serial_fd, buf, len);
+}
+
 // Callback for input activity on the serial fd
 static void
 input_event(struct serialqueue *sq, double eventtime)
 {
-    int ret = read(sq->serial_fd, &sq->input_buf[sq->input_pos]
+    int ret;
+    if (sq->shm) {
+        ret = shm_ring_read(&sq->shm->to_host, sq->serial_fd
+                            , &sq->input_buf[sq->input_pos]
+                            , sizeof(sq->input_buf) - sq->input_pos);
+        if (!ret)
+            return;
+    } else {
+        ret = read(sq->serial_fd, &sq->input_buf[sq->input_pos]
                    , sizeof(sq->input_buf) - sq->input_pos);
+    }
     if (ret <= 0) {
         report_errno("read", ret);
         pollreactor_do_exit(&sq->pr);
@@ -577,9 +646,12 @@ kick_event(struct serialqueue *sq, double eventtime)
 static double
 retransmit_event(struct serialqueue *sq, double eventtime)
 {
-    int ret = tcflush(sq->serial_fd, TCOFLUSH);
-    if (ret < 0)
-        report_errno("tcflush", ret);
+    int ret;
+    if (!sq->shm) {
+        ret = tcflush(sq->serial_fd, TCOFLUSH);
+        if (ret < 0)
+            report_errno("tcflush", ret);
+    }
 
     pthread_mutex_lock(&sq->lock);
 
@@ -594,7 +666,7 @@ retransmit_event(struct serialqueue *sq, double eventtime)
         if (!first_buflen)
             first_buflen = qm->len + 1;
     }
-    ret = write(sq->serial_fd, buf, buflen);
+    ret = serial_write(sq, buf, buflen);
     if (ret < 0)
         report_errno("retransmit write", ret);
     sq->bytes_retransmit += buflen;
@@ -667,7 +739,7 @@ build_and_send_command(struct serialqueue *sq, double eventtime)
     out->msg[out->len - MESSAGE_TRAILER_SYNC] = MESSAGE_SYNC;
 
     // Send message
-    int ret = write(sq->serial_fd, out->msg, out->len);
+    int ret = serial_write(sq, out->msg, out->len);
     if (ret < 0)
         report_errno("write", ret);
     sq->bytes_write += out->len;
@@ -777,13 +849,10 @@ background_thread(void *data)
     return NULL;
 }
 
-// Create a new 'struct serialqueue' object
-struct serialqueue *
-serialqueue_alloc(int serial_fd, int write_only)
+// Initialize a 'struct serialqueue' object and start its thread
+static struct serialqueue *
+serialqueue_setup(struct serialqueue *sq, int serial_fd, int write_only)
 {
-    struct serialqueue *sq = malloc(sizeof(*sq));
-    memset(sq, 0, sizeof(*sq));
-
     // Reactor setup
     sq->serial_fd = serial_fd;
     int ret = pipe(sq->pipe_fds);
@@ -839,6 +908,49 @@ fail:
     return NULL;
 }
 
+// Create a new 'struct serialqueue' object
+struct serialqueue *
+serialqueue_alloc(int serial_fd, int write_only)
+{
+    struct serialqueue *sq = malloc(sizeof(*sq));
+    memset(sq, 0, sizeof(*sq));
+    return serialqueue_setup(sq, serial_fd, write_only);
+}
+
+// Create a new 'struct serialqueue' object communicating with a local
+// mcu process over shared memory (name is the segment name "/...")
+struct serialqueue *
+serialqueue_alloc_shm(const char *name)
+{
+    struct shm_console *shm = shm_console_map(name);
+    if (!shm)
+        return NULL;
+    int wake_mcu_fd = shm_open_doorbell(name, "wake_mcu");
+    int wake_host_fd = shm_open_doorbell(name, "wake_host");
+    if (wake_mcu_fd < 0 || wake_host_fd < 0) {
+        if (wake_mcu_fd >= 0)
+            close(wake_mcu_fd);
+        if (wake_host_fd >= 0)
+            close(wake_host_fd);
+        munmap(shm, sizeof(*shm));
+        return NULL;
+    }
+    struct serialqueue *sq = malloc(sizeof(*sq));
+    memset(sq, 0, sizeof(*sq));
+    sq->shm = shm;
+    sq->shm_wake_mcu_fd = wake_mcu_fd;
+    // Pick up any data that arrived before the reactor started
+    shm_ring_wake(&shm->to_host, wake_host_fd);
+    if (!serialqueue_setup(sq, wake_host_fd, 0)) {
+        close(wake_mcu_fd);
+        close(wake_host_fd);
+        munmap(shm, sizeof(*shm));
+        free(sq);
+        return NULL;
+    }
+    return sq;
+}
+
 // Request that the background thread exit
 void
 serialqueue_exit(struct serialqueue *sq)
@@ -872,6 +984,11 @@ serialqueue_free(struct serialqueue *sq)
     }
     pthread_mutex_unlock(&sq->lock);
     pollreactor_free(&sq->pr);
+    if (sq->shm) {
+        close(sq->serial_fd);
+        close(sq->shm_wake_mcu_fd);
+        munmap(sq->shm, sizeof(*sq->shm));
+    }
     free(sq);
 }
 
@@ -22,6 +22,8 @@
 #include <string.h> // memset
 #include "pyhelper.h" // errorf
 #include "serialqueue.h" // struct queue_message
+#include "stepcompress.h" // ERROR_RET
+#include "vmcu.h" // vmcu_process
 
 #define CHECK_LINES 1
 #define QUEUE_START_SIZE 1024
@@ -187,8 +189,6 @@ compress_bisect_add(struct stepcompress *sc)
  * Step compress checking
  ****************************************************************/
 
-#define ERROR_RET -989898989
-
 // Verify that a given 'step_move' matches the actual step times
 static int
 check_line(struct stepcompress *sc, struct step_move move)
@@ -727,6 +727,10 @@ struct steppersync {
     // Storage for list of pending move clocks
     uint64_t *move_clocks;
     int num_move_clocks;
+    // Number of move queue items sent to the mcu (lower 16 bits)
+    uint16_t move_seq;
+    // Optional virtual mcu that is also fed all transmitted commands
+    struct vmcu *vmcu;
 };
 
 // Allocate a new 'steppersync' object
@@ -773,6 +777,14 @@ steppersync_set_time(struct steppersync *ss, double time_offset, double mcu_freq
     }
 }
 
+// Feed all commands generated by this steppersync to a virtual mcu.
+// If the steppersync has no serialqueue the commands are then dropped.
+void
+steppersync_set_vmcu(struct steppersync *ss, struct vmcu *vm)
+{
+    ss->vmcu = vm;
+}
+
 // Implement a binary heap algorithm to track when the next available
 // 'struct move' in the mcu will be available
 static void
@@ -798,6 +810,61 @@ heap_replace(struct steppersync *ss, uint64_t req_clock)
     }
 }
 
+static int
+clock_cmp(const void *p1, const void *p2)
+{
+    uint64_t c1 = *(uint64_t*)p1, c2 = *(uint64_t*)p2;
+    return c1 < c2 ? -1 : c1 > c2;
+}
+
+// Set the number of move queue items the mcu has allocated so far (a
+// restarted host must continue the sequence of the running mcu)
+void
+steppersync_set_move_seq(struct steppersync *ss, int move_seq)
+{
+    ss->move_seq = move_seq;
+}
+
+// Update the move queue estimate from an mcu status report.  The mcu
+// reports the number of free 'struct move' items, the number of items
+// it has allocated so far ('alloc_seq'), and a clock ('done_clock')
+// such that all moves that start at or before it have freed their
+// item.  Items the mcu is using beyond the estimate are held until
+// 'hold_clock' (the time of the next expected report), and items the
+// mcu has freed early (eg, moves discarded after homing) are released.
+void
+steppersync_note_move_status(struct steppersync *ss, uint64_t done_clock
+                             , int free_count, int alloc_seq
+                             , uint64_t hold_clock)
+{
+    uint64_t *mc = ss->move_clocks;
+    int nmc = ss->num_move_clocks;
+    // Items that the mcu had not yet received at the time of the report
+    int in_flight = (uint16_t)(ss->move_seq - alloc_seq);
+    if (free_count > nmc || in_flight > nmc)
+        // Report from before this steppersync was created
+        return;
+    // A sorted array is also a valid heap
+    qsort(mc, nmc, sizeof(*mc), clock_cmp);
+    int done = 0;
+    while (done < nmc && mc[done] <= done_clock)
+        done++;
+    int est_busy = nmc - done - in_flight, mcu_busy = nmc - free_count;
+    if (est_busy < 0)
+        return;
+    if (mcu_busy > est_busy) {
+        int count = mcu_busy - est_busy;
+        while (count-- && done)
+            mc[--done] = hold_clock;
+        qsort(mc, nmc, sizeof(*mc), clock_cmp);
+    } else {
+        // Release the earliest pending items (keeps the array sorted)
+        int count = est_busy - mcu_busy;
+        while (count--)
+            mc[done++] = done_clock;
+    }
+}
+
 // Find and transmit any scheduled steps prior to the given 'move_clock'
 int
 steppersync_flush(struct steppersync *ss, uint64_t move_clock)
@@ -832,11 +899,13 @@ steppersync_flush(struct steppersync *ss, uint64_t move_clock)
             break;
 
         uint64_t next_avail = ss->move_clocks[0];
-        if (qm->min_clock)
+        if (qm->min_clock) {
             // The qm->min_clock field is overloaded to indicate that
             // the command uses the 'move queue' and to store the time
             // that move queue item becomes available.
             heap_replace(ss, qm->min_clock);
+            ss->move_seq++;
+        }
         // Reset the min_clock to its normal meaning (minimum transmit time)
         qm->min_clock = next_avail;
 
@@ -846,7 +915,21 @@ steppersync_flush(struct steppersync *ss, uint64_t move_clock)
     }
 
     // Transmit commands
-    if (!list_empty(&msgs))
+    if (ss->vmcu) {
+        struct queue_message *qm;
+        list_for_each_entry(qm, &msgs, node) {
+            int ret = vmcu_process(ss->vmcu, qm->msg, qm->len);
+            if (ret) {
+                message_queue_free(&msgs);
+                return ret;
+            }
+        }
+    }
+    if (list_empty(&msgs))
+        return 0;
+    if (ss->sq)
         serialqueue_send_batch(ss->sq, ss->cq, &msgs);
+    else
+        message_queue_free(&msgs);
     return 0;
 }
@@ -0,0 +1,36 @@
+#ifndef STEPCOMPRESS_H
+#define STEPCOMPRESS_H
+
+#include <stdint.h> // int32_t
+
+#define ERROR_RET -989898989
+
+struct stepcompress *stepcompress_alloc(uint32_t max_error
+    , uint32_t queue_step_msgid, uint32_t set_next_step_dir_msgid
+    , uint32_t invert_sdir, uint32_t oid);
+void stepcompress_free(struct stepcompress *sc);
+int stepcompress_reset(struct stepcompress *sc, uint64_t last_step_clock);
+int stepcompress_set_homing(struct stepcompress *sc, uint64_t homing_clock);
+int stepcompress_queue_msg(struct stepcompress *sc, uint32_t *data, int len);
+int32_t stepcompress_push(struct stepcompress *sc, double print_time
+    , int32_t sdir);
+int32_t stepcompress_push_const(struct stepcompress *sc, double print_time
+    , double step_offset, double steps, double start_sv, double accel);
+int32_t stepcompress_push_delta(struct stepcompress *sc, double print_time
+    , double move_sd, double start_sv, double accel, double height
+    , double startxy_sd, double arm_d, double movez_r);
+
+struct serialqueue;
+struct vmcu;
+struct steppersync *steppersync_alloc(struct serialqueue *sq
+    , struct stepcompress **sc_list, int sc_num, int move_num);
+void steppersync_free(struct steppersync *ss);
+void steppersync_set_time(struct steppersync *ss, double time_offset
+    , double mcu_freq);
+void steppersync_set_vmcu(struct steppersync *ss, struct vmcu *vm);
+void steppersync_set_move_seq(struct steppersync *ss, int move_seq);
+void steppersync_note_move_status(struct steppersync *ss, uint64_t done_clock
+    , int free_count, int alloc_seq, uint64_t hold_clock);
+int steppersync_flush(struct steppersync *ss, uint64_t move_clock);
+
+#endif // stepcompress.h
@@ -4,7 +4,10 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import math, logging
-import homing, pins
+import homing, pins, chelper
+
+class error(Exception):
+    pass
 
 # Tracking of shared stepper enable pins
 class StepperEnablePin:
@@ -33,6 +36,22 @@ def lookup_enable_pin(printer, pin):
         pin_params['class'] = enable = StepperEnablePin(mcu_enable)
     return enable
 
+# Step generation for the steppers of a robot (see klippy/kinematics.c)
+class StepperKinematics:
+    def __init__(self, kin_name, steppers):
+        ffi_main, self.ffi_lib = chelper.get_ffi()
+        self.ckin = ffi_main.gc(self.ffi_lib.kinematics_alloc(kin_name),
+                                self.ffi_lib.kinematics_free)
+        for axis, s in enumerate(steppers):
+            s.setup_kinematics(self.ckin, axis)
+    def set_tower(self, axis, tower, arm2):
+        self.ffi_lib.kinematics_set_tower(
+            self.ckin, axis, tower[0], tower[1], arm2)
+    def move(self, print_time, move):
+        ret = self.ffi_lib.kinematics_move(self.ckin, move.lmove, print_time)
+        if ret:
+            raise error("Internal error in stepcompress")
+
 # Code storing the definitions for a stepper motor
 class PrinterStepper:
     def __init__(self, printer, config):
@@ -48,8 +67,7 @@ class PrinterStepper:
         self.mcu_stepper.setup_dir_pin(dir_pin_params)
         self.step_dist = config.getfloat('step_distance', above=0.)
         self.mcu_stepper.setup_step_distance(self.step_dist)
-        self.step_const = self.mcu_stepper.step_const
-        self.step_delta = self.mcu_stepper.step_delta
+        self.step_extrude = self.mcu_stepper.step_extrude
         self.enable = lookup_enable_pin(printer, config.get('enable_pin', None))
     def _dist_to_time(self, dist, start_velocity, accel):
         # Calculate the time it takes to travel a distance with constant accel
@@ -65,6 +83,8 @@ class PrinterStepper:
         self.mcu_stepper.setup_min_stop_interval(min_stop_interval)
     def set_position(self, pos):
         self.mcu_stepper.set_position(pos)
+    def setup_kinematics(self, kin, axis):
+        self.mcu_stepper.setup_kinematics(kin, axis)
     def motor_enable(self, print_time, enable=0):
         if self.need_motor_enable != (not enable):
             self.enable.set_enable(print_time, enable)
@@ -167,14 +187,12 @@ class PrinterMultiStepper(PrinterHomingStepper):
         PrinterHomingStepper.__init__(self, printer, config)
         self.endstops = PrinterHomingStepper.get_endstops(self)
         self.extras = []
-        self.all_step_const = [self.step_const]
         for i in range(1, 99):
             if not config.has_section(config.section + str(i)):
                 break
             extraconfig = config.getsection(config.section + str(i))
             extra = PrinterStepper(printer, extraconfig)
             self.extras.append(extra)
-            self.all_step_const.append(extra.step_const)
             extraendstop = extraconfig.get('endstop_pin', None)
             if extraendstop is not None:
                 mcu_endstop = pins.setup_pin(printer, 'endstop', extraendstop)
@@ -182,10 +200,6 @@ class PrinterMultiStepper(PrinterHomingStepper):
                 self.endstops.append((mcu_endstop, extra.name))
             else:
                 self.mcu_endstop.add_stepper(extra.mcu_stepper)
-        self.step_const = self.step_multi_const
-    def step_multi_const(self, print_time, start_pos, dist, start_v, accel):
-        for step_const in self.all_step_const:
-            step_const(print_time, start_pos, dist, start_v, accel)
     def set_max_jerk(self, max_halt_velocity, max_accel):
         PrinterHomingStepper.set_max_jerk(self, max_halt_velocity, max_accel)
         for extra in self.extras:
@@ -194,6 +208,10 @@ class PrinterMultiStepper(PrinterHomingStepper):
         PrinterHomingStepper.set_position(self, pos)
         for extra in self.extras:
             extra.set_position(pos)
+    def setup_kinematics(self, kin, axis):
+        PrinterHomingStepper.setup_kinematics(self, kin, axis)
+        for extra in self.extras:
+            extra.setup_kinematics(kin, axis)
     def motor_enable(self, print_time, enable=0):
         PrinterHomingStepper.motor_enable(self, print_time, enable)
         for extra in self.extras:
@@ -4,7 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import math, logging
-import mcu, homing, cartesian, corexy, delta, extruder
+import mcu, homing, cartesian, corexy, delta, extruder, chelper
 
 # Common suffixes: _d is distance (in mm), _v is velocity (in
 #   mm/second), _v2 is velocity squared (mm^2/s^2), _t is time (in
@@ -31,7 +31,6 @@ class Move:
         self.max_start_v2 = 0.
         self.max_cruise_v2 = speed**2
         self.delta_v2 = 2.0 * move_d * self.accel
-        self.max_smoothed_v2 = 0.
         self.smooth_delta_v2 = 2.0 * move_d * toolhead.max_accel_to_decel
     def limit_speed(self, speed, accel):
         speed2 = speed**2
@@ -41,47 +40,21 @@ class Move:
         self.accel = min(self.accel, accel)
         self.delta_v2 = 2.0 * self.move_d * self.accel
         self.smooth_delta_v2 = min(self.smooth_delta_v2, self.delta_v2)
-    def calc_junction(self, prev_move):
-        if not self.is_kinematic_move or not prev_move.is_kinematic_move:
-            return
-        # Allow extruder to calculate its maximum junction
-        extruder_v2 = self.toolhead.extruder.calc_junction(prev_move, self)
-        # Find max velocity using approximated centripetal velocity as
-        # described at:
-        # https://onehossshay.wordpress.com/2011/09/24/improving_grbl_cornering_algorithm/
-        axes_d = self.axes_d
-        prev_axes_d = prev_move.axes_d
-        junction_cos_theta = -((axes_d[0] * prev_axes_d[0]
-                                + axes_d[1] * prev_axes_d[1]
-                                + axes_d[2] * prev_axes_d[2])
-                               / (self.move_d * prev_move.move_d))
-        if junction_cos_theta > 0.999999:
-            return
-        junction_cos_theta = max(junction_cos_theta, -0.999999)
-        sin_theta_d2 = math.sqrt(0.5*(1.0-junction_cos_theta))
-        R = self.toolhead.junction_deviation * sin_theta_d2 / (1. - sin_theta_d2)
-        self.max_start_v2 = min(
-            R * self.accel, R * prev_move.accel, extruder_v2
-            , self.max_cruise_v2, prev_move.max_cruise_v2
-            , prev_move.max_start_v2 + prev_move.delta_v2)
-        self.max_smoothed_v2 = min(
-            self.max_start_v2
-            , prev_move.max_smoothed_v2 + prev_move.smooth_delta_v2)
-    def set_junction(self, start_v2, cruise_v2, end_v2):
-        # Determine accel, cruise, and decel portions of the move distance
-        inv_delta_v2 = 1. / self.delta_v2
-        self.accel_r = accel_r = (cruise_v2 - start_v2) * inv_delta_v2
-        self.decel_r = decel_r = (cruise_v2 - end_v2) * inv_delta_v2
-        self.cruise_r = cruise_r = 1. - accel_r - decel_r
-        # Determine move velocities
-        self.start_v = start_v = math.sqrt(start_v2)
-        self.cruise_v = cruise_v = math.sqrt(cruise_v2)
-        self.end_v = end_v = math.sqrt(end_v2)
-        # Determine time spent in each portion of move (time is the
-        # distance divided by average velocity)
-        self.accel_t = accel_r * self.move_d / ((start_v + cruise_v) * 0.5)
-        self.cruise_t = cruise_r * self.move_d / cruise_v
-        self.decel_t = decel_r * self.move_d / ((end_v + cruise_v) * 0.5)
+    def set_junction(self, lmoves, index):
+        # Load the accel, cruise, and decel portions of the move (as
+        # planned by the C lookahead code).  A reference to the array
+        # is kept so that self.lmove remains valid.
+        self.lmoves = lmoves
+        self.lmove = lm = lmoves + index
+        self.accel_r = lm.accel_r
+        self.cruise_r = lm.cruise_r
+        self.decel_r = lm.decel_r
+        self.start_v = lm.start_v
+        self.cruise_v = lm.cruise_v
+        self.end_v = lm.end_v
+        self.accel_t = lm.accel_t
+        self.cruise_t = lm.cruise_t
+        self.decel_t = lm.decel_t
     def move(self):
         # Generate step times for the move
         next_move_time = self.toolhead.get_next_move_time()
@@ -97,14 +70,17 @@ LOOKAHEAD_FLUSH_TIME = 0.250
 # Class to track a list of pending move requests and to facilitate
 # "look-ahead" across moves to reduce acceleration between moves.
 class MoveQueue:
-    def __init__(self):
+    def __init__(self, junction_deviation):
         self.extruder_lookahead = None
         self.queue = []
-        self.leftover = 0
         self.junction_flush = LOOKAHEAD_FLUSH_TIME
+        self.ffi_main, self.ffi_lib = chelper.get_ffi()
+        self.lookahead = self.ffi_main.gc(
+            self.ffi_lib.lookahead_alloc(junction_deviation),
+            self.ffi_lib.lookahead_free)
     def reset(self):
         del self.queue[:]
-        self.leftover = 0
+        self.ffi_lib.lookahead_reset(self.lookahead)
         self.junction_flush = LOOKAHEAD_FLUSH_TIME
     def set_flush_time(self, flush_time):
         self.junction_flush = flush_time
@@ -112,64 +88,46 @@ class MoveQueue:
         self.extruder_lookahead = extruder.lookahead
     def flush(self, lazy=False):
         self.junction_flush = LOOKAHEAD_FLUSH_TIME
-        update_flush_count = lazy
         queue = self.queue
-        flush_count = len(queue)
-        # Traverse queue from last to first move and determine maximum
-        # junction speed assuming the robot comes to a complete stop
-        # after the last move.
-        delayed = []
-        next_end_v2 = next_smoothed_v2 = peak_cruise_v2 = 0.
-        for i in range(flush_count-1, self.leftover-1, -1):
-            move = queue[i]
-            reachable_start_v2 = next_end_v2 + move.delta_v2
-            start_v2 = min(move.max_start_v2, reachable_start_v2)
-            reachable_smoothed_v2 = next_smoothed_v2 + move.smooth_delta_v2
-            smoothed_v2 = min(move.max_smoothed_v2, reachable_smoothed_v2)
-            if smoothed_v2 < reachable_smoothed_v2:
-                # It's possible for this move to accelerate
-                if (smoothed_v2 + move.smooth_delta_v2 > next_smoothed_v2
-                    or delayed):
-                    # This move can decelerate or this is a full accel
-                    # move after a full decel move
-                    if update_flush_count and peak_cruise_v2:
-                        flush_count = i
-                        update_flush_count = False
-                    peak_cruise_v2 = min(move.max_cruise_v2, (
-                        smoothed_v2 + reachable_smoothed_v2) * .5)
-                    if delayed:
-                        # Propagate peak_cruise_v2 to any delayed moves
-                        if not update_flush_count and i < flush_count:
-                            for m, ms_v2, me_v2 in delayed:
-                                mc_v2 = min(peak_cruise_v2, ms_v2)
-                                m.set_junction(min(ms_v2, mc_v2), mc_v2
-                                               , min(me_v2, mc_v2))
-                        del delayed[:]
-                if not update_flush_count and i < flush_count:
-                    cruise_v2 = min((start_v2 + reachable_start_v2) * .5
-                                    , move.max_cruise_v2, peak_cruise_v2)
-                    move.set_junction(min(start_v2, cruise_v2), cruise_v2
-                                      , min(next_end_v2, cruise_v2))
-            else:
-                # Delay calculating this move until peak_cruise_v2 is known
-                delayed.append((move, start_v2, next_end_v2))
-            next_end_v2 = start_v2
-            next_smoothed_v2 = smoothed_v2
-        if update_flush_count:
+        # Determine the junction velocities of all moves that can be
+        # flushed (see lookahead.c)
+        flush_count = self.ffi_lib.lookahead_flush(self.lookahead, lazy)
+        if flush_count < 0:
             return
+        lmoves = self.ffi_lib.lookahead_get_moves(self.lookahead)
         # Allow extruder to do its lookahead
-        move_count = self.extruder_lookahead(queue, flush_count, lazy)
-        # Generate step times for all moves ready to be flushed
-        for move in queue[:move_count]:
+        move_count = self.extruder_lookahead(lmoves, flush_count, lazy)
+        # Generate step times for all moves ready to be flushed (using
+        # a copy of the C moves, as the lookahead queue is reallocated
+        # when moves are added)
+        ffi_main = self.ffi_main
+        lcopy = ffi_main.new('struct lookahead_move[]', move_count)
+        ffi_main.memmove(lcopy, lmoves, ffi_main.sizeof(lcopy))
+        for i in range(move_count):
+            move = queue[i]
+            move.set_junction(lcopy, i)
             move.move()
         # Remove processed moves from the queue
-        self.leftover = flush_count - move_count
+        self.ffi_lib.lookahead_pop(self.lookahead, move_count, flush_count)
         del queue[:move_count]
     def add_move(self, move):
-        self.queue.append(move)
-        if len(self.queue) == 1:
+        queue = self.queue
+        queue.append(move)
+        extruder_v2 = 0.
+        if len(queue) > 1:
+            prev_move = queue[-2]
+            if move.is_kinematic_move and prev_move.is_kinematic_move:
+                # Allow extruder to calculate its maximum junction
+                extruder_v2 = move.toolhead.extruder.calc_junction(
+                    prev_move, move)
+        start_pos, end_pos = move.start_pos, move.end_pos
+        move.max_start_v2 = self.ffi_lib.lookahead_add_move(
+            self.lookahead, start_pos[0], start_pos[1], start_pos[2],
+            end_pos[0], end_pos[1], end_pos[2], move.move_d,
+            move.is_kinematic_move, move.accel, move.max_cruise_v2,
+            move.delta_v2, move.smooth_delta_v2, extruder_v2)
+        if len(queue) == 1:
             return
-        move.calc_junction(self.queue[-2])
         self.junction_flush -= move.min_move_t
         if self.junction_flush <= 0.:
             # There are enough queued moves to return to zero velocity
@@ -178,6 +136,7 @@ class MoveQueue:
             self.flush(lazy=True)
 
 STALL_TIME = 0.100
+MAX_ARC_SEGMENTS = 2048
 
 # Main code to track events (and their timing) on the printer toolhead
 class ToolHead:
@@ -193,8 +152,12 @@ class ToolHead:
             , above=0., maxval=self.max_accel)
         self.junction_deviation = config.getfloat(
             'junction_deviation', 0.02, minval=0.)
-        self.move_queue = MoveQueue()
+        self.move_queue = MoveQueue(self.junction_deviation)
         self.commanded_pos = [0., 0., 0., 0.]
+        # Arc support
+        self.arc_tolerance = config.getfloat('arc_tolerance', 0.01, above=0.)
+        ffi_main, self.ffi_lib = chelper.get_ffi()
+        self.arc_coords = ffi_main.new('double[]', MAX_ARC_SEGMENTS * 4)
         # Print time tracking
         self.buffer_time_low = config.getfloat(
             'buffer_time_low', 1.000, above=0.)
@@ -329,6 +292,25 @@ class ToolHead:
         self.move_queue.add_move(move)
         if self.print_time > self.need_check_stall:
             self._check_stall()
+    def arc_move(self, newpos, offset_i, offset_j, radius, clockwise, speed):
+        # Convert the arc into linear moves (see klippy/arcs.c)
+        cpos = self.commanded_pos
+        coords = self.arc_coords
+        count = self.ffi_lib.arc_segments(
+            coords, MAX_ARC_SEGMENTS, cpos[0], cpos[1], cpos[2], cpos[3],
+            newpos[0], newpos[1], newpos[2], newpos[3],
+            offset_i, offset_j, radius, clockwise, self.arc_tolerance)
+        if count < 0:
+            msg = "Invalid arc"
+            if count == self.ffi_lib.ARC_ERROR_RADIUS:
+                msg = "Arc end position is not on the arc"
+            elif count == self.ffi_lib.ARC_ERROR_SEGMENTS:
+                msg = ("Arc needs more than %d moves"
+                       " (increase arc_tolerance)" % (MAX_ARC_SEGMENTS,))
+            raise homing.EndstopMoveError(newpos, msg)
+        for i in range(0, count * 4, 4):
+            self.move([coords[i], coords[i+1], coords[i+2], coords[i+3]],
+                      speed)
     def dwell(self, delay, check_stall=True):
         self.get_last_move_time()
         self.update_move_time(delay)
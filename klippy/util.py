@@ -37,6 +37,30 @@ def create_pty(ptyname):
     termios.tcsetattr(mfd, termios.TCSADRAIN, old)
     return mfd
 
+# Read the contents of a cache file (or None if it is not available)
+def read_cache_file(filename):
+    try:
+        f = open(filename, 'rb')
+        data = f.read()
+        f.close()
+    except (IOError, OSError):
+        return None
+    return data
+
+# Atomically replace a cache file (creating its directory if needed)
+def write_cache_file(filename, data):
+    try:
+        dirname = os.path.dirname(filename)
+        if dirname and not os.path.isdir(dirname):
+            os.makedirs(dirname)
+        tmpname = "%s.%d.tmp" % (filename, os.getpid())
+        f = open(tmpname, 'wb')
+        f.write(data)
+        f.close()
+        os.rename(tmpname, filename)
+    except (IOError, OSError) as e:
+        logging.warn("Unable to write cache file %s: %s", filename, e)
+
 def get_cpu_info():
     try:
         f = open('/proc/cpuinfo', 'rb')
@@ -0,0 +1,204 @@
+// Virtual micro-controller step reconstruction
+//
+// Copyright (C) 2017  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+//
+// This code consumes the encoded stepper commands that would be sent
+// to a micro-controller (queue_step, set_next_step_dir, and
+// reset_step_clock) and executes them using the same arithmetic as
+// src/stepper.c.  The resulting step times (extended to 64bit clocks)
+// and step positions are recorded so that host code can verify the
+// compressed step stream without real hardware.
+
+#include <stdint.h> // uint32_t
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "pyhelper.h" // errorf
+#include "vmcu.h" // vmcu_alloc
+
+#define MAX_OIDS 256
+
+struct vmcu_stepper {
+    // Step generation state (as in src/stepper.c)
+    uint32_t next_step_time;
+    int next_dir, dir;
+    int32_t position;
+    uint64_t last_clock;
+    // Recorded steps
+    uint64_t *clocks;
+    int32_t *positions;
+    int count, size, extract_pos;
+};
+
+struct vmcu {
+    uint32_t queue_step_msgid, set_next_step_dir_msgid, reset_step_clock_msgid;
+    struct vmcu_stepper *steppers[MAX_OIDS];
+};
+
+// Allocate a new 'vmcu' object
+struct vmcu *
+vmcu_alloc(uint32_t queue_step_msgid, uint32_t set_next_step_dir_msgid
+           , uint32_t reset_step_clock_msgid)
+{
+    struct vmcu *vm = malloc(sizeof(*vm));
+    memset(vm, 0, sizeof(*vm));
+    vm->queue_step_msgid = queue_step_msgid;
+    vm->set_next_step_dir_msgid = set_next_step_dir_msgid;
+    vm->reset_step_clock_msgid = reset_step_clock_msgid;
+    return vm;
+}
+
+// Free memory associated with a 'vmcu' object
+void
+vmcu_free(struct vmcu *vm)
+{
+    if (!vm)
+        return;
+    int i;
+    for (i=0; i<MAX_OIDS; i++) {
+        struct vmcu_stepper *s = vm->steppers[i];
+        if (!s)
+            continue;
+        free(s->clocks);
+        free(s->positions);
+        free(s);
+    }
+    free(vm);
+}
+
+// Find (or create) the state for a given stepper oid
+static struct vmcu_stepper *
+vmcu_stepper(struct vmcu *vm, uint32_t oid)
+{
+    if (oid >= MAX_OIDS)
+        return NULL;
+    struct vmcu_stepper *s = vm->steppers[oid];
+    if (!s) {
+        s = malloc(sizeof(*s));
+        memset(s, 0, sizeof(*s));
+        vm->steppers[oid] = s;
+    }
+    return s;
+}
+
+// Decode a variable length integer (see src/command.c)
+static int
+parse_int(uint8_t **pp, uint8_t *end, uint32_t *v)
+{
+    uint8_t *p = *pp;
+    if (p >= end)
+        return -1;
+    uint8_t c = *p++;
+    uint32_t val = c & 0x7f;
+    if ((c & 0x60) == 0x60)
+        val |= -0x20;
+    while (c & 0x80) {
+        if (p >= end)
+            return -1;
+        c = *p++;
+        val = (val<<7) | (c & 0x7f);
+    }
+    *pp = p;
+    *v = val;
+    return 0;
+}
+
+// Record the steps of a queue_step command
+static int
+vmcu_queue_step(struct vmcu_stepper *s, uint32_t interval, uint16_t count
+                , int16_t add)
+{
+    if (!count) {
+        errorf("vmcu: Invalid count parameter");
+        return -1;
+    }
+    if (s->count + count > s->size) {
+        int size = s->size ? s->size : 1024;
+        while (s->count + count > size)
+            size *= 2;
+        s->clocks = realloc(s->clocks, size * sizeof(*s->clocks));
+        s->positions = realloc(s->positions, size * sizeof(*s->positions));
+        s->size = size;
+    }
+    s->dir = s->next_dir;
+    int sdir = s->dir ? 1 : -1;
+    uint32_t next_step_time = s->next_step_time;
+    uint64_t last_clock = s->last_clock;
+    int32_t position = s->position;
+    uint64_t *clocks = &s->clocks[s->count];
+    int32_t *positions = &s->positions[s->count];
+    int i;
+    for (i=0; i<count; i++) {
+        next_step_time += interval;
+        interval += add;
+        last_clock += (int32_t)(next_step_time - (uint32_t)last_clock);
+        position += sdir;
+        clocks[i] = last_clock;
+        positions[i] = position;
+    }
+    s->next_step_time = next_step_time;
+    s->last_clock = last_clock;
+    s->position = position;
+    s->count += count;
+    return 0;
+}
+
+// Execute a single encoded command.  Commands other than the stepper
+// commands above are ignored.
+int
+vmcu_process(struct vmcu *vm, uint8_t *msg, int len)
+{
+    uint8_t *p = msg, *end = &msg[len];
+    uint32_t msgid, oid, args[3];
+    if (parse_int(&p, end, &msgid))
+        goto error;
+    int num_args;
+    if (msgid == vm->queue_step_msgid)
+        num_args = 3;
+    else if (msgid == vm->set_next_step_dir_msgid
+             || msgid == vm->reset_step_clock_msgid)
+        num_args = 1;
+    else
+        return 0;
+    if (parse_int(&p, end, &oid))
+        goto error;
+    int i;
+    for (i=0; i<num_args; i++)
+        if (parse_int(&p, end, &args[i]))
+            goto error;
+    struct vmcu_stepper *s = vmcu_stepper(vm, oid);
+    if (!s)
+        goto error;
+    if (msgid == vm->queue_step_msgid)
+        return vmcu_queue_step(s, args[0], args[1], args[2]);
+    if (msgid == vm->set_next_step_dir_msgid)
+        s->next_dir = !!args[0];
+    else
+        s->next_step_time = args[0];
+    return 0;
+error:
+    errorf("vmcu: Invalid message");
+    return -1;
+}
+
+// Extract the recorded steps of a stepper (oldest first).  Returns
+// the number of steps copied.
+int
+vmcu_extract_steps(struct vmcu *vm, uint32_t oid, uint64_t *clocks
+                   , int32_t *positions, int max)
+{
+    if (oid >= MAX_OIDS || !vm->steppers[oid])
+        return 0;
+    struct vmcu_stepper *s = vm->steppers[oid];
+    int avail = s->count - s->extract_pos;
+    if (avail > max)
+        avail = max;
+    memcpy(clocks, &s->clocks[s->extract_pos], avail * sizeof(*clocks));
+    memcpy(positions, &s->positions[s->extract_pos]
+           , avail * sizeof(*positions));
+    s->extract_pos += avail;
+    if (s->extract_pos >= s->count)
+        s->count = s->extract_pos = 0;
+    return avail;
+}
@@ -0,0 +1,13 @@
+#ifndef VMCU_H
+#define VMCU_H
+
+#include <stdint.h> // uint32_t
+
+struct vmcu *vmcu_alloc(uint32_t queue_step_msgid
+    , uint32_t set_next_step_dir_msgid, uint32_t reset_step_clock_msgid);
+void vmcu_free(struct vmcu *vm);
+int vmcu_process(struct vmcu *vm, uint8_t *msg, int len);
+int vmcu_extract_steps(struct vmcu *vm, uint32_t oid, uint64_t *clocks
+                       , int32_t *positions, int max);
+
+#endif // vmcu.h
@@ -5,7 +5,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import sys, os, subprocess, optparse, logging, shlex, socket, time, traceback
-import json, zlib
+import json, zlib, struct
 sys.path.append('./klippy')
 import msgproto
 
@@ -146,10 +146,42 @@ def build_param_types(all_param_types):
     params.append('')
     return "\n".join(params)
 
+# Command flag requesting a dedicated parser (must match src/command.h)
+HF_FAST_PARSE = 0x02
+
+# Integer parameter types that can be decoded with command_parse_int()
+INT_PARAM_TYPES = ('PT_uint32', 'PT_int32', 'PT_uint16', 'PT_int16', 'PT_byte')
+
+# Build an unrolled parser (with the integer decoding inlined) for a
+# hot command
+def build_command_parser(parser, flags):
+    if not sum([int(f, 0) for f in flags.split('|')]) & HF_FAST_PARSE:
+        return None, None
+    types = [t.__class__.__name__ for t in parser.param_types]
+    if not types or [t for t in types if t not in INT_PARAM_TYPES]:
+        error("Command '%s' can not use HF_FAST_PARSE" % (parser.msgformat,))
+    funcname = 'command_parse_%d' % (parser.msgid,)
+    code = ["""
+    if (p > maxend)
+        command_parse_error();
+    args[%d] = command_parse_int(&p);""" % (i,) for i in range(len(types))]
+    fmt = """
+// Parser for: %s
+static char *
+%s(char *p, char *maxend, uint32_t *args)
+{
+    %s
+    return p;
+}
+"""
+    return funcname, fmt % (parser.msgformat, funcname,
+                            "".join(code).strip())
+
 def build_commands(cmd_by_id, messages_by_name, all_param_types):
     max_cmd_msgid = max(cmd_by_id.keys())
     index = []
     externs = {}
+    parsers = []
     for msgid in range(max_cmd_msgid+1):
         if msgid not in cmd_by_id:
             index.append(" {\n},")
@@ -159,6 +191,10 @@ def build_commands(cmd_by_id, messages_by_name, all_param_types):
         externs[funcname] = 1
         parser = msgproto.MessageFormat(msgid, msg)
         parsercode = build_parser(parser, 1, all_param_types)
+        parsefunc, parsefunc_code = build_command_parser(parser, flags)
+        if parsefunc is not None:
+            parsers.append(parsefunc_code)
+            parsercode += "\n    .parse=%s," % (parsefunc,)
         index.append(" {%s\n    .flags=%s,\n    .func=%s\n}," % (
             parsercode, flags, funcname))
     index = "".join(index).strip()
@@ -166,14 +202,14 @@ def build_commands(cmd_by_id, messages_by_name, all_param_types):
                          for funcname in sorted(externs)])
     fmt = """
 %s
-
+%s
 const struct command_parser command_index[] PROGMEM = {
 %s
 };
 
 const uint8_t command_index_size PROGMEM = ARRAY_SIZE(command_index);
 """
-    return fmt % (externs, index)
+    return fmt % (externs, "".join(parsers), index)
 
 
 ######################################################################
@@ -202,6 +238,9 @@ def build_identify(cmd_by_id, msg_to_id, responses, static_strings
         if i % 8 == 0:
             out.append('\n   ')
         out.append(" 0x%02x," % (ord(zdata[i]),))
+    # The identify hash is the size and crc32 of the compressed data
+    ihash = struct.pack('<II', len(zdata), zlib.crc32(zdata) & 0xffffffff)
+    hashout = "\n   " + "".join([" 0x%02x," % (ord(c),) for c in ihash])
     fmt = """
 // version: %s
 // build_versions: %s
@@ -212,8 +251,12 @@ const uint8_t command_identify_data[] PROGMEM = {%s
 // Identify size = %d (%d uncompressed)
 const uint32_t command_identify_size PROGMEM
     = ARRAY_SIZE(command_identify_data);
+
+const uint8_t command_identify_hash[] PROGMEM = {%s
+};
 """
-    return data, fmt % (version, toolstr, ''.join(out), len(zdata), len(data))
+    return data, fmt % (version, toolstr, ''.join(out), len(zdata), len(data)
+                        , hashout)
 
 
 ######################################################################
@@ -318,7 +361,7 @@ def main():
     encoders = []
     static_strings = []
     constants = {}
-    call_lists = {'ctr_run_initfuncs': []}
+    call_lists = {'ctr_run_initfuncs': [], 'ctr_run_finalizefuncs': []}
     # Parse request file
     f = open(incmdfile, 'rb')
     data = f.read()
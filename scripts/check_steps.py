@@ -0,0 +1,157 @@
+#!/usr/bin/env python2
+# Verify the compressed step stream using the virtual mcu (vmcu.c)
+#
+# Copyright (C) 2017  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, math, random
+sys.path.append(os.path.join(os.path.dirname(__file__), '../klippy'))
+import chelper
+
+MCU_FREQ = 16000000.
+STEPPERS = 3
+STEP_DIST = .0125
+QUEUE_STEP_MSGID, SET_NEXT_STEP_DIR_MSGID, RESET_STEP_CLOCK_MSGID = 1, 2, 3
+STEPCOMPRESS_ERROR_RET = -989898989
+
+# Host side model of a stepper - schedules steps with
+# stepcompress_push_const() and records the ideal time of each step
+class Stepper:
+    def __init__(self, ffi, lib, oid, max_error):
+        self.lib = lib
+        self.oid = oid
+        self.sc = ffi.gc(lib.stepcompress_alloc(
+            max_error, QUEUE_STEP_MSGID, SET_NEXT_STEP_DIR_MSGID, 0, oid),
+                         lib.stepcompress_free)
+        self.commanded_pos = 0.
+        self.position = 0
+        self.ideal = []
+    def step_const(self, print_time, start_pos, dist, start_v, accel):
+        inv_step_dist = 1. / STEP_DIST
+        step_offset = self.commanded_pos - start_pos * inv_step_dist
+        steps = dist * inv_step_dist
+        count = self.lib.stepcompress_push_const(
+            self.sc, print_time, step_offset, steps,
+            start_v * inv_step_dist, accel * inv_step_dist)
+        if count == STEPCOMPRESS_ERROR_RET:
+            raise Exception("Internal error in stepcompress")
+        # Record the expected clock of each step
+        sdir = 1
+        if steps < 0.:
+            sdir = -1
+            step_offset = -step_offset
+        sv, sa = start_v * inv_step_dist, accel * inv_step_dist
+        for i in range(abs(count)):
+            d = step_offset + .5 + i
+            if sa:
+                t = (math.sqrt(sv*sv + 2.*sa*d) - sv) / sa
+            else:
+                t = d / sv
+            self.position += sdir
+            self.ideal.append((int((print_time + t) * MCU_FREQ + .5),
+                               self.position))
+        self.commanded_pos += count
+
+# Schedule a trapezoidal move on a stepper (start and end at rest)
+def trapezoid_move(stepper, print_time, start_pos, dist, max_v, accel):
+    adist = abs(dist)
+    sign = 1. if dist >= 0. else -1.
+    accel_d = min(.5 * max_v**2 / accel, .5 * adist)
+    cruise_v = math.sqrt(2. * accel * accel_d)
+    accel_t = cruise_v / accel
+    cruise_d = adist - 2. * accel_d
+    cruise_t = cruise_d / cruise_v
+    stepper.step_const(print_time, start_pos, sign * accel_d, 0., accel)
+    print_time += accel_t
+    start_pos += sign * accel_d
+    if cruise_d:
+        stepper.step_const(print_time, start_pos, sign * cruise_d
+                           , cruise_v, 0.)
+        print_time += cruise_t
+        start_pos += sign * cruise_d
+    stepper.step_const(print_time, start_pos, sign * accel_d, cruise_v, -accel)
+    return print_time + accel_t, start_pos + sign * accel_d
+
+# Compare the steps executed by the vmcu with the ideal step times
+def check_stepper(ffi, lib, vm, stepper, max_error):
+    max_steps = len(stepper.ideal) + 1
+    clocks = ffi.new('uint64_t[]', max_steps)
+    positions = ffi.new('int32_t[]', max_steps)
+    count = lib.vmcu_extract_steps(vm, stepper.oid, clocks, positions
+                                   , max_steps)
+    if count != len(stepper.ideal):
+        return "oid %d: expected %d steps but vmcu executed %d" % (
+            stepper.oid, len(stepper.ideal), count)
+    worst = 0
+    for i, (ideal_clock, ideal_pos) in enumerate(stepper.ideal):
+        if positions[i] != ideal_pos:
+            return "oid %d step %d: position %d (expected %d)" % (
+                stepper.oid, i, positions[i], ideal_pos)
+        # Steps may be scheduled up to max_error early (but not late).
+        # Allow one clock of slack for rounding of the ideal time.
+        err = ideal_clock - clocks[i]
+        if err < -1 or err > max_error + 1:
+            return "oid %d step %d: clock %d off by %d (max_error %d)" % (
+                stepper.oid, i, clocks[i], err, max_error)
+        worst = max(worst, abs(err))
+    return worst
+
+def run_test(ffi, lib, max_error, moves, seed):
+    random.seed(seed)
+    steppers = [Stepper(ffi, lib, oid, max_error) for oid in range(STEPPERS)]
+    c_list = ffi.new('struct stepcompress*[]', [s.sc for s in steppers])
+    ss = ffi.gc(lib.steppersync_alloc(ffi.NULL, c_list, len(steppers), 16)
+                , lib.steppersync_free)
+    lib.steppersync_set_time(ss, 0., MCU_FREQ)
+    vm = ffi.gc(lib.vmcu_alloc(QUEUE_STEP_MSGID, SET_NEXT_STEP_DIR_MSGID
+                               , RESET_STEP_CLOCK_MSGID), lib.vmcu_free)
+    lib.steppersync_set_vmcu(ss, vm)
+    print_time = .1
+    positions = [0.] * len(steppers)
+    for i in range(moves):
+        max_v = random.uniform(5., 300.)
+        accel = random.uniform(500., 5000.)
+        end_time = print_time
+        for j, s in enumerate(steppers):
+            dist = random.uniform(-20., 20.)
+            t, positions[j] = trapezoid_move(s, print_time, positions[j]
+                                             , dist, max_v, accel)
+            end_time = max(end_time, t)
+        print_time = end_time + random.choice([0., 0., .001, .5])
+        ret = lib.steppersync_flush(ss, int(print_time * MCU_FREQ))
+        if ret:
+            return "steppersync_flush failed"
+    worst = 0
+    for s in steppers:
+        res = check_stepper(ffi, lib, vm, s, max_error)
+        if isinstance(res, str):
+            return res
+        worst = max(worst, res)
+    return worst
+
+def main():
+    usage = "%prog [options]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-n", "--moves", type="int", dest="moves", default=200,
+                    help="number of moves per test (default 200)")
+    opts.add_option("-s", "--seed", type="int", dest="seed", default=1,
+                    help="random seed (default 1)")
+    options, args = opts.parse_args()
+    if args:
+        opts.error("Incorrect number of arguments")
+    ffi, lib = chelper.get_ffi()
+    failed = False
+    for max_error_us in [1., 5., 25., 100.]:
+        max_error = int(max_error_us * .000001 * MCU_FREQ)
+        res = run_test(ffi, lib, max_error, options.moves, options.seed)
+        if isinstance(res, str):
+            sys.stdout.write("max_error %5d: FAIL: %s\n" % (max_error, res))
+            failed = True
+        else:
+            sys.stdout.write("max_error %5d: ok (worst error %d)\n" % (
+                max_error, res))
+    if failed:
+        sys.exit(-1)
+
+if __name__ == '__main__':
+    main()
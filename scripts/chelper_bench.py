@@ -0,0 +1,106 @@
+#!/usr/bin/env python2
+# Measure the per-call cost of the klippy C helper functions
+#
+# Copyright (C) 2017  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, time
+sys.path.append(os.path.join(os.path.dirname(__file__), '../klippy'))
+import chelper
+
+MCU_FREQ = 16000000.
+STEPPERS = 4
+
+# Load the C helper code using the requested cffi mode
+def load(mode):
+    srcdir = os.path.dirname(os.path.realpath(chelper.__file__))
+    if mode == 'api':
+        res = chelper.load_api_module(srcdir)
+        if res is None:
+            sys.stderr.write("No up to date %s module"
+                             " (run 'make -C klippy chelper')\n"
+                             % (chelper.API_MODULE,))
+            sys.exit(-1)
+        return res
+    return chelper.load_abi_library(srcdir)
+
+# Create a steppersync (without a serialqueue) with several steppers
+def alloc_steppers(ffi, lib):
+    sc_list = [ffi.gc(lib.stepcompress_alloc(25, 1, 2, 0, oid)
+                      , lib.stepcompress_free)
+               for oid in range(STEPPERS)]
+    c_list = ffi.new('struct stepcompress*[]', sc_list)
+    ss = ffi.gc(lib.steppersync_alloc(ffi.NULL, c_list, len(sc_list), 16)
+                , lib.steppersync_free)
+    lib.steppersync_set_time(ss, 0., MCU_FREQ)
+    return ss, sc_list
+
+# Queue single steps with stepcompress_push()
+def bench_queue_step(ffi, lib, count):
+    ss, sc_list = alloc_steppers(ffi, lib)
+    sc = sc_list[0]
+    push, flush = lib.stepcompress_push, lib.steppersync_flush
+    step_time = .0001
+    start_time = time.time()
+    for i in range(count):
+        push(sc, (i + 1) * step_time, 1)
+        if not i % 1000:
+            flush(ss, int(i * step_time * MCU_FREQ))
+    flush(ss, int((count + 1) * step_time * MCU_FREQ))
+    return time.time() - start_time
+
+# Flush an empty queue (the cost is mostly the call itself)
+def bench_flush_idle(ffi, lib, count):
+    ss, sc_list = alloc_steppers(ffi, lib)
+    flush = lib.steppersync_flush
+    start_time = time.time()
+    for i in range(count):
+        flush(ss, i)
+    return time.time() - start_time
+
+# Flush after queuing a short move on each stepper (only the
+# steppersync_flush() calls are timed)
+def bench_flush_move(ffi, lib, count):
+    ss, sc_list = alloc_steppers(ffi, lib)
+    push_const, flush = lib.stepcompress_push_const, lib.steppersync_flush
+    move_t, steps = .002, 10.
+    total_time = 0.
+    for i in range(count):
+        print_time = i * move_t
+        for sc in sc_list:
+            push_const(sc, print_time, 0., steps, steps / move_t, 0.)
+        start_time = time.time()
+        flush(ss, int((print_time + move_t) * MCU_FREQ))
+        total_time += time.time() - start_time
+    return total_time
+
+BENCHMARKS = [
+    ('queue_step', bench_queue_step),
+    ('flush_idle', bench_flush_idle),
+    ('flush_move', bench_flush_move),
+]
+
+def main():
+    usage = "%prog [options]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-n", "--count", type="int", dest="count", default=200000,
+                    help="number of calls per benchmark (default 200000)")
+    opts.add_option("-m", "--mode", type="choice", dest="modes",
+                    action="append", choices=['abi', 'api'],
+                    help="cffi mode to measure (default abi and api)")
+    opts.add_option("-r", "--repeat", type="int", dest="repeat", default=3,
+                    help="report the best of this many runs (default 3)")
+    options, args = opts.parse_args()
+    if args:
+        opts.error("Incorrect number of arguments")
+    modes = options.modes or ['abi', 'api']
+    for mode in modes:
+        ffi, lib = load(mode)
+        for name, func in BENCHMARKS:
+            best = min([func(ffi, lib, options.count)
+                        for i in range(options.repeat)])
+            sys.stdout.write("%-4s %-11s %8.1f ns/call\n" % (
+                mode, name, best / options.count * 1e9))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,111 @@
+#!/usr/bin/env python2
+# Benchmark the rate G-Code lines can be streamed to klippy
+#
+# Copyright (C) 2017  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, select, termios, time
+
+# Give up if klippy does not respond for this long (in seconds)
+RESPONSE_TIMEOUT = 60.
+
+# Open the klippy pseudo-tty in raw mode
+def open_tty(ttyname):
+    fd = os.open(ttyname, os.O_RDWR | os.O_NOCTTY)
+    attrs = termios.tcgetattr(fd)
+    attrs[0] = attrs[1] = attrs[3] = 0
+    attrs[2] = attrs[2] | termios.CS8 | termios.CREAD | termios.CLOCAL
+    termios.tcsetattr(fd, termios.TCSANOW, attrs)
+    return fd
+
+class Streamer:
+    def __init__(self, fd):
+        self.fd = fd
+        self.partial = ""
+        self.errors = 0
+        self.last_response = time.time()
+    def read_lines(self, timeout):
+        res = select.select([self.fd], [], [], timeout)[0]
+        if not res:
+            if time.time() > self.last_response + RESPONSE_TIMEOUT:
+                raise IOError("No response from klippy for %.0f seconds" % (
+                    RESPONSE_TIMEOUT,))
+            return []
+        data = os.read(self.fd, 4096)
+        if not data:
+            raise EOFError("tty closed")
+        self.last_response = time.time()
+        lines = (self.partial + data).split('\n')
+        self.partial = lines.pop()
+        for line in lines:
+            if line.startswith('!!'):
+                self.errors += 1
+        return lines
+    def command(self, cmd):
+        # Send a command and wait for its "ok"
+        os.write(self.fd, cmd + "\n")
+        self.last_response = time.time()
+        while 1:
+            for line in self.read_lines(5.):
+                if line.startswith('ok'):
+                    return line
+    def stream(self, lines, window):
+        # Send lines keeping at most 'window' unacknowledged
+        pos = acked = 0
+        while acked < len(lines):
+            if pos < len(lines) and pos - acked < window:
+                count = min(window - (pos - acked), len(lines) - pos)
+                os.write(self.fd, "".join(lines[pos:pos+count]))
+                pos += count
+            for line in self.read_lines(5.):
+                if line.startswith('ok'):
+                    acked += 1
+
+# Generate short moves back and forth along the X axis
+def gen_moves(count, seg_d, speed):
+    out = ["G1 F%.1f\n" % (speed * 60.,)]
+    for i in range(count):
+        out.append("G1 X%.3f Y%.3f\n" % (
+            10. + (i % 100) * seg_d, 10. + (i % 2) * seg_d))
+    return out
+
+def main():
+    usage = "%prog [options] <klippy tty>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-n", "--count", type="int", dest="count", default=20000,
+                    help="number of lines to send (default 20000)")
+    opts.add_option("-w", "--window", type="int", dest="window",
+                    help="lines in flight (default is the reported WINDOW)")
+    opts.add_option("-d", "--distance", type="float", dest="seg_d",
+                    default=0.1, help="length of each move in mm")
+    opts.add_option("-s", "--speed", type="float", dest="speed", default=100.,
+                    help="requested speed in mm/s")
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect number of arguments")
+    fd = open_tty(args[0])
+    streamer = Streamer(fd)
+
+    # Query the window size advertised by klippy
+    window = 1
+    for kv in streamer.command("M115").split()[1:]:
+        if kv.startswith("WINDOW:"):
+            window = int(kv[7:])
+    if options.window is not None:
+        window = options.window
+    window = max(1, window)
+    streamer.command("G28")
+    streamer.command("G90")
+
+    lines = gen_moves(options.count, options.seg_d, options.speed)
+    start_time = time.time()
+    streamer.stream(lines, window)
+    total_time = time.time() - start_time
+    print "Sent %d lines (window %d) in %.3f seconds: %.1f lines/sec" % (
+        len(lines), window, total_time, len(lines) / total_time)
+    if streamer.errors:
+        print "%d error responses" % (streamer.errors,)
+    os.close(fd)
+
+if __name__ == '__main__':
+    main()
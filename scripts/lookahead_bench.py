@@ -0,0 +1,90 @@
+#!/usr/bin/env python2
+# Benchmark the toolhead look-ahead planner with many small moves
+#
+# Copyright (C) 2017  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, math, time
+sys.path.append(os.path.join(os.path.dirname(__file__), '../klippy'))
+import toolhead
+
+# Minimal stand-ins for the printer objects used by the move queue
+class DummyKin:
+    def move(self, print_time, move):
+        pass
+class DummyToolHead:
+    def __init__(self, max_accel, max_accel_to_decel):
+        self.max_accel = max_accel
+        self.max_accel_to_decel = max_accel_to_decel
+        self.kin = DummyKin()
+        self.extruder = toolhead.extruder.DummyExtruder()
+        self.print_time = 0.
+    def get_next_move_time(self):
+        return self.print_time
+    def update_move_time(self, movetime):
+        self.print_time += movetime
+
+# Generate the end positions of a path made of short segments
+def gen_path(pattern, count, seg_d):
+    if pattern == 'line':
+        for i in range(count):
+            yield ((i + 1) * seg_d, 0., 0.)
+    elif pattern == 'zigzag':
+        for i in range(count):
+            yield ((i + 1) * seg_d, (i % 2) * seg_d, 0.)
+    else:
+        # Spiral with a slowly shrinking radius
+        angle = 0.
+        for i in range(count):
+            radius = 50. - 40. * i / count
+            angle += seg_d / radius
+            yield (radius * math.cos(angle), radius * math.sin(angle), 0.)
+
+def main():
+    usage = "%prog [options]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-n", "--count", type="int", dest="count", default=100000,
+                    help="number of moves (default 100000)")
+    opts.add_option("-d", "--distance", type="float", dest="seg_d",
+                    default=0.2, help="length of each move in mm")
+    opts.add_option("-s", "--speed", type="float", dest="speed", default=200.,
+                    help="requested speed in mm/s")
+    opts.add_option("-a", "--accel", type="float", dest="accel", default=3000.,
+                    help="max_accel in mm/s^2")
+    opts.add_option("-p", "--pattern", type="choice", dest="pattern",
+                    choices=['spiral', 'line', 'zigzag'], default='spiral',
+                    help="path shape (spiral, line, or zigzag)")
+    options, args = opts.parse_args()
+    if args:
+        opts.error("Incorrect number of arguments")
+
+    th = DummyToolHead(options.accel, options.accel * 0.5)
+    mq = toolhead.MoveQueue(0.02)
+    mq.set_extruder(th.extruder)
+    # Count the flushes the move queue performs
+    flush_counts = [0, 0]
+    orig_flush = mq.flush
+    def flush(lazy=False):
+        flush_counts[lazy] += 1
+        orig_flush(lazy)
+    mq.flush = flush
+
+    pos = [0., 0., 0., 0.]
+    moves = []
+    for x, y, z in gen_path(options.pattern, options.count, options.seg_d):
+        end_pos = [x, y, z, 0.]
+        moves.append(toolhead.Move(th, pos, end_pos, options.speed))
+        pos = end_pos
+    start_time = time.time()
+    for move in moves:
+        mq.add_move(move)
+    mq.flush()
+    total_time = time.time() - start_time
+
+    print("%d moves in %.3f seconds (%.2fus per move)" % (
+        len(moves), total_time, total_time * 1000000. / len(moves)))
+    print("%d lazy flushes, %d full flushes, %.3f seconds of motion" % (
+        flush_counts[True], flush_counts[False], th.print_time))
+
+if __name__ == '__main__':
+    main()
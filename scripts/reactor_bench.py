@@ -0,0 +1,71 @@
+#!/usr/bin/env python2
+# Measure the timer wakeup lateness of the klippy reactors
+#
+# Copyright (C) 2017  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, random
+sys.path.append(os.path.join(os.path.dirname(__file__), '../klippy'))
+import reactor
+
+REACTORS = {
+    'select': reactor.SelectReactor, 'poll': reactor.PollReactor,
+    'epoll': reactor.EPollReactor, 'timerfd': reactor.TimerFDReactor }
+
+# Run a timer (and optionally a pausing greenlet) with random delays
+def measure(reactor_class, count, max_delay, use_pause):
+    r = reactor_class()
+    lateness = []
+    state = {'waketime': r.NOW}
+    def timer_event(eventtime):
+        if state['waketime']:
+            lateness.append(r.monotonic() - state['waketime'])
+        if len(lateness) >= count:
+            r.end()
+            return r.NEVER
+        state['waketime'] = r.monotonic() + random.uniform(0., max_delay)
+        return state['waketime']
+    def pause_event(eventtime):
+        while len(lateness) < count:
+            waketime = r.monotonic() + random.uniform(0., max_delay)
+            r.pause(waketime)
+            lateness.append(r.monotonic() - waketime)
+        r.end()
+        return r.NEVER
+    if use_pause:
+        r.register_timer(pause_event, r.NOW)
+    else:
+        r.register_timer(timer_event, r.NOW)
+    r.run()
+    return sorted(lateness[:count])
+
+def report(name, lateness):
+    def pct(p):
+        return lateness[min(len(lateness) - 1, int(len(lateness) * p))] * 1e6
+    avg = sum(lateness) / len(lateness) * 1e6
+    print "%-8s avg %7.1fus p50 %7.1fus p90 %7.1fus p99 %7.1fus max %7.1fus" % (
+        name, avg, pct(.50), pct(.90), pct(.99), lateness[-1] * 1e6)
+
+def main():
+    usage = "%prog [options]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-n", "--count", type="int", dest="count", default=2000,
+                    help="number of wakeups to measure (default 2000)")
+    opts.add_option("-d", "--delay", type="float", dest="max_delay",
+                    default=0.005, help="maximum timer delay in seconds")
+    opts.add_option("-p", "--pause", action="store_true", dest="use_pause",
+                    help="measure greenlet pause() wakeups instead of timers")
+    opts.add_option("-r", "--reactor", type="choice", dest="reactors",
+                    action="append", choices=sorted(REACTORS.keys()),
+                    help="reactor to measure (default all)")
+    options, args = opts.parse_args()
+    if args:
+        opts.error("Incorrect number of arguments")
+    names = options.reactors or ['select', 'poll', 'epoll', 'timerfd']
+    for name in names:
+        lateness = measure(REACTORS[name], options.count, options.max_delay
+                           , options.use_pause)
+        report(name, lateness)
+
+if __name__ == '__main__':
+    main()
@@ -5,6 +5,7 @@
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include <string.h> // memset
+#include "autoconf.h" // CONFIG_*
 #include "basecmd.h" // oid_lookup
 #include "board/irq.h" // irq_save
 #include "board/misc.h" // alloc_maxsize
@@ -58,14 +59,17 @@ alloc_chunks(size_t size, size_t count, uint16_t *avail)
  * Move queue
  ****************************************************************/
 
+// Moves are referenced by a compact non-zero index into move_list
+// (zero is used as a "no move" marker).
 struct move_freed {
-    struct move_freed *next;
+    uint16_t next;
 };
 
-static struct move_freed *move_free_list;
-static void *move_list;
-static uint16_t move_count;
-static uint8_t move_item_size;
+static uint16_t move_free_list;
+void *move_list;
+static uint16_t move_count, move_free_count, move_alloc_seq;
+uint8_t move_item_size;
+static uint32_t move_done_clock;
 
 // Is the config and move queue finalized?
 static int
@@ -77,24 +81,48 @@ is_finalized(void)
 // Free previously allocated storage from move_alloc(). Caller must
 // disable irqs.
 void
-move_free(void *m)
+move_free(uint16_t m)
 {
-    struct move_freed *mf = m;
+    struct move_freed *mf = move_get(m);
     mf->next = move_free_list;
-    move_free_list = mf;
+    move_free_list = m;
+    move_free_count++;
 }
 
 // Allocate runtime storage
-void *
+uint16_t
 move_alloc(void)
 {
     irqstatus_t flag = irq_save();
-    struct move_freed *mf = move_free_list;
-    if (!mf)
+    uint16_t m = move_free_list;
+    if (!m)
         shutdown("Move queue empty");
+    struct move_freed *mf = move_get(m);
     move_free_list = mf->next;
+    move_free_count--;
+    move_alloc_seq++;
+    irq_restore(flag);
+    return m;
+}
+
+// Note that the moves scheduled to start at or before 'clock' have
+// been started (and their storage freed).  Caller must disable irqs.
+void
+move_note_done(uint32_t clock)
+{
+    if (timer_is_before(move_done_clock, clock))
+        move_done_clock = clock;
+}
+
+// Report the number of free and total move queue items (the total is
+// zero until the config is finalized)
+void
+move_queue_info(uint16_t *free_count, uint16_t *count)
+{
+    irqstatus_t flag = irq_save();
+    *free_count = move_free_count;
+    *count = move_count;
     irq_restore(flag);
-    return mf;
 }
 
 // Request minimum size of runtime allocations returned by move_alloc()
@@ -113,23 +141,23 @@ move_reset(void)
     if (!move_count)
         return;
     // Add everything in move_list to the free list.
-    uint32_t i;
-    for (i=0; i<move_count-1; i++) {
-        struct move_freed *mf = move_list + i*move_item_size;
-        mf->next = move_list + (i + 1)*move_item_size;
+    uint16_t i;
+    for (i=1; i<move_count; i++) {
+        struct move_freed *mf = move_get(i);
+        mf->next = i + 1;
     }
-    struct move_freed *mf = move_list + (move_count - 1)*move_item_size;
-    mf->next = NULL;
-    move_free_list = move_list;
+    struct move_freed *mf = move_get(move_count);
+    mf->next = 0;
+    move_free_list = 1;
+    move_free_count = move_count;
 }
 DECL_SHUTDOWN(move_reset);
 
 static void
 move_finalize(void)
 {
-    if (is_finalized())
-        shutdown("Already finalized");
-    move_request_size(sizeof(*move_free_list));
+    move_request_size(sizeof(struct move_freed));
+    move_item_size = ALIGN(move_item_size, __alignof__(struct move_freed));
     move_list = alloc_chunks(move_item_size, 1024, &move_count);
     move_reset();
 }
@@ -154,6 +182,21 @@ oid_lookup(uint8_t oid, void *type)
     return oids[oid].data;
 }
 
+// Allocate a table (indexed by oid) of the objects of the given type
+// - the entries of oids with another type are NULL.  Hot command
+// handlers can then index the table instead of calling oid_lookup().
+void **
+oid_table_alloc(void *type, uint8_t *count)
+{
+    void **table = alloc_chunk(sizeof(*table) * oid_count);
+    uint8_t i;
+    for (i=0; i<oid_count; i++)
+        if (oids[i].type == type)
+            table[i] = oids[i].data;
+    *count = oid_count;
+    return table;
+}
+
 void *
 oid_alloc(uint8_t oid, void *type, uint16_t size)
 {
@@ -209,6 +252,10 @@ DECL_COMMAND_FLAGS(command_get_config, HF_IN_SHUTDOWN, "get_config");
 void
 command_finalize_config(uint32_t *args)
 {
+    if (is_finalized())
+        shutdown("Already finalized");
+    extern void ctr_run_finalizefuncs(void);
+    ctr_run_finalizefuncs();
     move_finalize();
     config_crc = args[0];
     command_get_config(NULL);
@@ -225,9 +272,9 @@ config_reset(uint32_t *args)
     config_crc = 0;
     oid_count = 0;
     oids = NULL;
-    move_free_list = NULL;
+    move_free_list = 0;
     move_list = NULL;
-    move_count = move_item_size = 0;
+    move_count = move_free_count = move_alloc_seq = move_item_size = 0;
     alloc_init();
     sched_timer_reset();
     sched_clear_shutdown();
@@ -239,10 +286,25 @@ config_reset(uint32_t *args)
  * Timing and load stats
  ****************************************************************/
 
+// Report the current time along with the state of the move queue (so
+// the host can track the actual move queue usage).  The report
+// contains the number of unused items, the number of items allocated
+// so far, and the latest clock at which a queued move was started.
 void
 command_get_status(uint32_t *args)
 {
-    sendf("status clock=%u status=%c", timer_read_time(), sched_is_shutdown());
+    irq_disable();
+    uint16_t free_count = move_free_count, alloc_seq = move_alloc_seq;
+    uint32_t cur = timer_read_time(), done_clock = move_done_clock;
+    if (free_count == move_count)
+        // Nothing is queued - all moves up to now have been started
+        // (also keeps move_done_clock from going stale across a wrap
+        // of the 32bit clock while idle)
+        move_done_clock = done_clock = cur;
+    irq_enable();
+    sendf("status clock=%u status=%c move_free=%hu move_seq=%hu"
+          " move_clock=%u", cur, sched_is_shutdown(), free_count, alloc_seq
+          , done_clock);
 }
 DECL_COMMAND_FLAGS(command_get_status, HF_IN_SHUTDOWN, "get_status");
 
@@ -260,11 +322,63 @@ DECL_COMMAND_FLAGS(command_get_uptime, HF_IN_SHUTDOWN, "get_uptime");
 #define SUMSQ_BASE 256
 DECL_CONSTANT(STATS_SUMSQ_BASE, SUMSQ_BASE);
 
+// Histograms of timer lateness and main loop time.  Bucket 0 counts
+// values less than (1<<HIST_SHIFT) ticks and each following bucket
+// counts values up to twice as large as the previous bucket.  The
+// last bucket counts all larger values.
+#define HIST_SHIFT 3
+#define HIST_SIZE 12
+DECL_CONSTANT(STATS_HIST_SHIFT, HIST_SHIFT);
+
+struct stats_hist {
+    uint32_t max;
+    uint32_t counts[HIST_SIZE];
+};
+
+static struct stats_hist timer_hist, loop_hist;
+
+static void
+stats_hist_add(struct stats_hist *h, uint32_t v)
+{
+    if (v > h->max)
+        h->max = v;
+    uint32_t b = v >> HIST_SHIFT;
+    uint_fast8_t pos = b ? sizeof(long)*8 - __builtin_clzl(b) : 0;
+    if (pos >= HIST_SIZE)
+        pos = HIST_SIZE - 1;
+    if (h->counts[pos] != UINT32_MAX)
+        h->counts[pos]++;
+}
+
+static void
+stats_hist_send(uint8_t type, struct stats_hist *h)
+{
+    uint8_t data[HIST_SIZE * 4], len = sizeof(data), i;
+    for (i=0; i<HIST_SIZE; i++) {
+        uint32_t count = h->counts[i];
+        data[i*4] = count >> 24;
+        data[i*4 + 1] = count >> 16;
+        data[i*4 + 2] = count >> 8;
+        data[i*4 + 3] = count;
+    }
+    sendf("stats_hist type=%c max=%u hist=%*s", type, h->max, len, data);
+}
+
+// Note the lateness of a timer dispatch - called from timer irq code
+void
+stats_note_timer(uint32_t late)
+{
+    if ((int32_t)late < 0)
+        late = 0;
+    stats_hist_add(&timer_hist, late);
+}
+
 void
 stats_update(uint32_t start, uint32_t cur)
 {
     static uint32_t count, sum, sumsq;
     uint32_t diff = cur - start;
+    stats_hist_add(&loop_hist, diff);
     count++;
     sum += diff;
     // Calculate sum of diff^2 - be careful of integer overflow
@@ -283,6 +397,15 @@ stats_update(uint32_t start, uint32_t cur)
     if (timer_is_before(cur, stats_send_time + timer_from_us(5000000)))
         return;
     sendf("stats count=%u sum=%u sumsq=%u", count, sum, sumsq);
+    if (CONFIG_TIMER_STATS) {
+        irq_disable();
+        struct stats_hist th = timer_hist;
+        memset(&timer_hist, 0, sizeof(timer_hist));
+        irq_enable();
+        stats_hist_send(0, &th);
+    }
+    stats_hist_send(1, &loop_hist);
+    memset(&loop_hist, 0, sizeof(loop_hist));
     if (cur < stats_send_time)
         stats_send_time_high++;
     stats_send_time = cur;
@@ -308,11 +431,20 @@ command_clear_shutdown(uint32_t *args)
 }
 DECL_COMMAND_FLAGS(command_clear_shutdown, HF_IN_SHUTDOWN, "clear_shutdown");
 
+// Requests at this offset report the size and crc32 of the data
+// dictionary so that the host may use a cached copy of it.
+#define IDENTIFY_HASH_OFFSET 0xffffffff
+
 void
 command_identify(uint32_t *args)
 {
     uint32_t offset = args[0];
     uint8_t count = args[1];
+    if (offset == IDENTIFY_HASH_OFFSET) {
+        sendf("identify_response offset=%u data=%.*s"
+              , offset, sizeof(command_identify_hash), command_identify_hash);
+        return;
+    }
     uint32_t isize = READP(command_identify_size);
     if (offset >= isize)
         count = 0;
@@ -2,13 +2,32 @@
 #define __BASECMD_H
 
 #include <stdint.h> // uint8_t
+#include "sched.h" // _DECL_CALLLIST
 
-void move_free(void *m);
-void *move_alloc(void);
+// Declare a function to run when the config is finalized (before the
+// move queue is allocated from the remaining memory)
+#define DECL_FINALIZE(FUNC) _DECL_CALLLIST(ctr_run_finalizefuncs, FUNC)
+
+extern void *move_list;
+extern uint8_t move_item_size;
+
+// Return the storage for a given move index
+static inline void *
+move_get(uint16_t m)
+{
+    return move_list + (m - 1) * move_item_size;
+}
+
+void move_free(uint16_t m);
+uint16_t move_alloc(void);
+void move_note_done(uint32_t clock);
+void move_queue_info(uint16_t *free_count, uint16_t *count);
 void move_request_size(int size);
 void *oid_lookup(uint8_t oid, void *type);
+void **oid_table_alloc(void *type, uint8_t *count);
 void *oid_alloc(uint8_t oid, void *type, uint16_t size);
 void *oid_next(uint8_t *i, void *type);
+void stats_note_timer(uint32_t late);
 void stats_update(uint32_t start, uint32_t cur);
 void config_reset(uint32_t *args);
 
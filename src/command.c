@@ -37,23 +37,6 @@ f4: *p++ = v & 0x7f;
     return p;
 }
 
-// Parse an integer that was encoded as a "variable length quantity"
-static uint32_t
-parse_int(char **pp)
-{
-    char *p = *pp;
-    uint8_t c = *p++;
-    uint32_t v = c & 0x7f;
-    if ((c & 0x60) == 0x60)
-        v |= -0x20;
-    while (c & 0x80) {
-        c = *p++;
-        v = (v<<7) | (c & 0x7f);
-    }
-    *pp = p;
-    return v;
-}
-
 // Parse an incoming command into 'args'
 char *
 command_parsef(char *p, char *maxend
@@ -72,14 +55,14 @@ command_parsef(char *p, char *maxend
         case PT_uint16:
         case PT_int16:
         case PT_byte:
-            *args++ = parse_int(&p);
+            *args++ = command_parse_int(&p);
             break;
         case PT_buffer: {
             uint8_t len = *p++;
             if (p + len > maxend)
                 goto error;
             *args++ = len;
-            *args++ = (size_t)p;
+            *args++ = command_encode_ptr(p);
             p += len;
             break;
         }
@@ -89,6 +72,13 @@ command_parsef(char *p, char *maxend
     }
     return p;
 error:
+    command_parse_error();
+}
+
+// Report an invalid command parameter block
+void
+command_parse_error(void)
+{
     shutdown("Command parser error");
 }
 
@@ -278,17 +268,26 @@ nak:
     return -1;
 }
 
+// Start of the message block being dispatched (see command_encode_ptr)
+char *command_ptr_base;
+
 // Dispatch all the commands found in a message block
 void
 command_dispatch(char *buf, uint8_t msglen)
 {
+    command_ptr_base = buf;
     char *p = &buf[MESSAGE_HEADER_SIZE];
     char *msgend = &buf[msglen-MESSAGE_TRAILER_SIZE];
     while (p < msgend) {
         uint8_t cmdid = *p++;
         const struct command_parser *cp = command_lookup_parser(cmdid);
         uint32_t args[READP(cp->num_args)];
-        p = command_parsef(p, msgend, cp, args);
+        char *(*parse)(char*, char*, uint32_t*) = READP(cp->parse);
+        if (parse)
+            // Use the command specific parser from compile_time_request.c
+            p = parse(p, msgend, args);
+        else
+            p = command_parsef(p, msgend, cp, args);
         if (sched_is_shutdown() && !(READP(cp->flags) & HF_IN_SHUTDOWN)) {
             sched_report_shutdown();
             continue;
@@ -298,3 +297,22 @@ command_dispatch(char *buf, uint8_t msglen)
         func(args);
     }
 }
+
+// Find and dispatch every complete message block in a buffer.  The
+// '*pos' offset is advanced past each block before it is dispatched
+// (so a shutdown during dispatch does not cause it to be reprocessed).
+void
+command_dispatch_all(char *buf, uint16_t *pos, uint16_t buf_len)
+{
+    for (;;) {
+        char *p = &buf[*pos];
+        uint16_t avail = buf_len - *pos;
+        uint8_t pop_count, msglen = avail > MESSAGE_MAX ? MESSAGE_MAX : avail;
+        int8_t ret = command_find_block(p, msglen, &pop_count);
+        if (!ret)
+            return;
+        *pos += pop_count;
+        if (ret > 0)
+            command_dispatch(p, pop_count);
+    }
+}
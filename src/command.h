@@ -14,6 +14,7 @@
 
 // Flags for command handler declarations.
 #define HF_IN_SHUTDOWN   0x01   // Handler can run even when in emergency stop
+#define HF_FAST_PARSE    0x02   // Build a dedicated parser (for hot commands)
 
 // Declare a constant exported to the host
 #define DECL_CONSTANT(NAME, VALUE)              \
@@ -53,6 +54,7 @@ struct command_encoder {
 struct command_parser {
     uint8_t msg_id, num_args, flags, num_params;
     const uint8_t *param_types;
+    char *(*parse)(char *p, char *maxend, uint32_t *args);
     void (*func)(uint32_t *args);
 };
 enum {
@@ -60,7 +62,47 @@ enum {
     PT_string, PT_progmem_buffer, PT_buffer,
 };
 
+// Parse an integer that was encoded as a "variable length quantity"
+static __always_inline uint32_t
+command_parse_int(char **pp)
+{
+    char *p = *pp;
+    uint8_t c = *p++;
+    uint32_t v = c & 0x7f;
+    if ((c & 0x60) == 0x60)
+        v |= -0x20;
+    while (c & 0x80) {
+        c = *p++;
+        v = (v<<7) | (c & 0x7f);
+    }
+    *pp = p;
+    return v;
+}
+
+// Buffer parameters are passed to command handlers as a pointer in a
+// uint32_t argument.  On hosts with 64bit pointers the argument holds
+// the offset of the buffer from the start of the message block being
+// dispatched instead.
+extern char *command_ptr_base;
+
+static inline uint32_t
+command_encode_ptr(void *p)
+{
+    if (sizeof(size_t) > sizeof(uint32_t))
+        return (char*)p - command_ptr_base;
+    return (size_t)p;
+}
+
+static inline void *
+command_decode_ptr(uint32_t v)
+{
+    if (sizeof(size_t) > sizeof(uint32_t))
+        return command_ptr_base + v;
+    return (void*)(size_t)v;
+}
+
 // command.c
+void command_parse_error(void) __noreturn;
 char *command_parsef(char *p, char *maxend
                      , const struct command_parser *cp, uint32_t *args);
 uint8_t command_encodef(char *buf, const struct command_encoder *ce
@@ -69,12 +111,14 @@ void command_sendf(const struct command_encoder *ce, ...);
 void command_add_frame(char *buf, uint8_t msglen);
 int8_t command_find_block(char *buf, uint8_t buf_len, uint8_t *pop_count);
 void command_dispatch(char *buf, uint8_t msglen);
+void command_dispatch_all(char *buf, uint16_t *pos, uint16_t buf_len);
 
 // out/compile_time_request.c (auto generated file)
 extern const struct command_parser command_index[];
 extern const uint8_t command_index_size;
 extern const uint8_t command_identify_data[];
 extern const uint32_t command_identify_size;
+extern const uint8_t command_identify_hash[8];
 const struct command_encoder *ctr_lookup_encoder(const char *str);
 const struct command_encoder *ctr_lookup_output(const char *str);
 uint8_t ctr_lookup_static_string(const char *str);
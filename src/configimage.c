@@ -0,0 +1,177 @@
+// Storage of a printer config that is re-applied at startup
+//
+// Copyright (C) 2017  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+//
+// The host may store its config commands (in the binary encoding
+// used on the serial link) in a board specific persistent store.  At
+// startup a stored image is validated (against the data dictionary
+// hash of this build and a crc of the image) and its commands are
+// then dispatched just as if they had been sent by the host.  The
+// micro-controller is thus configured immediately after a reset and
+// the host only needs to verify the reported config crc.
+
+#include <string.h> // memset
+#include "board/misc.h" // config_store_read
+#include "board/pgm.h" // READP
+#include "command.h" // DECL_COMMAND
+#include "sched.h" // DECL_TASK
+
+#define CONFIG_IMAGE_MAGIC 0x6b43494b
+
+// The image is stored after this header.  Each command in the image
+// is prefixed by its length.
+struct config_image_header {
+    uint32_t magic, config_crc;
+    uint8_t identify_hash[8];
+    uint16_t size, crc;
+};
+
+static uint8_t is_applied;
+
+// Calculate the crc16_ccitt of the image data in the store
+static uint16_t
+image_crc(uint16_t size)
+{
+    uint16_t crc = 0xffff, pos = sizeof(struct config_image_header);
+    uint16_t end = pos + size;
+    while (pos < end) {
+        uint8_t buf[32], len = sizeof(buf), i;
+        if (end - pos < len)
+            len = end - pos;
+        config_store_read(pos, buf, len);
+        pos += len;
+        for (i=0; i<len; i++) {
+            uint8_t data = buf[i];
+            data ^= crc & 0xff;
+            data ^= data << 4;
+            crc = ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4)
+                   ^ ((uint16_t)data << 3));
+        }
+    }
+    return crc;
+}
+
+// Return the space available for an image
+static uint16_t
+image_max_size(void)
+{
+    uint16_t store_size = config_store_size();
+    if (store_size < sizeof(struct config_image_header))
+        return 0;
+    return store_size - sizeof(struct config_image_header);
+}
+
+// Read the image header and verify the image is valid for this build
+static int
+image_check(struct config_image_header *h)
+{
+    if (!image_max_size())
+        return -1;
+    config_store_read(0, h, sizeof(*h));
+    if (h->magic != CONFIG_IMAGE_MAGIC || h->size > image_max_size())
+        return -1;
+    uint8_t i;
+    for (i=0; i<sizeof(h->identify_hash); i++)
+        if (h->identify_hash[i] != READP(command_identify_hash[i]))
+            return -1;
+    if (image_crc(h->size) != h->crc)
+        return -1;
+    return 0;
+}
+
+// Dispatch the commands of a stored image
+static void
+image_apply(void)
+{
+    struct config_image_header h;
+    if (image_check(&h))
+        return;
+    uint16_t pos = sizeof(h), end = pos + h.size;
+    while (pos < end) {
+        char buf[MESSAGE_MAX];
+        uint8_t len;
+        config_store_read(pos++, &len, 1);
+        if (len > MESSAGE_PAYLOAD_MAX || len > end - pos)
+            shutdown("Invalid config image");
+        config_store_read(pos, &buf[MESSAGE_HEADER_SIZE], len);
+        pos += len;
+        command_dispatch(buf, len + MESSAGE_MIN);
+    }
+    is_applied = 1;
+}
+
+// Apply any stored image on the first pass of the main loop.  This
+// can not be an init function - the image commands depend on the
+// state set up by the other init functions (which may run after this
+// one), and a shutdown() raised while dispatching them is only
+// handled once sched_main() has entered its main loop.
+void
+config_image_task(void)
+{
+    static uint8_t is_started;
+    if (is_started)
+        return;
+    is_started = 1;
+    image_apply();
+}
+DECL_TASK(config_image_task);
+
+// Report the stored image (is_applied is only reported once after
+// the image is restored, so that a host that reconnects without a
+// reset does not mistake its own config for a restored one)
+void
+command_config_image_query(uint32_t *args)
+{
+    struct config_image_header h;
+    uint8_t is_valid = !image_check(&h);
+    sendf("config_image is_valid=%c is_applied=%c config_crc=%u"
+          " max_size=%hu", is_valid, is_applied
+          , is_valid ? h.config_crc : 0, image_max_size());
+    is_applied = 0;
+}
+DECL_COMMAND_FLAGS(command_config_image_query, HF_IN_SHUTDOWN,
+                   "config_image_query");
+
+void
+command_config_image_write(uint32_t *args)
+{
+    uint16_t offset = args[0];
+    uint8_t len = args[1];
+    char *data = command_decode_ptr(args[2]);
+    if (offset + len > image_max_size())
+        shutdown("Config image too large");
+    if (!offset) {
+        // Invalidate the current image before overwriting it
+        uint32_t magic = 0;
+        config_store_write(0, &magic, sizeof(magic));
+    }
+    config_store_write(sizeof(struct config_image_header) + offset
+                       , data, len);
+}
+DECL_COMMAND_FLAGS(command_config_image_write, HF_IN_SHUTDOWN,
+                   "config_image_write offset=%hu data=%*s");
+
+// Validate the written image and store its header (a size of zero
+// removes any stored image)
+void
+command_config_image_commit(uint32_t *args)
+{
+    struct config_image_header h;
+    memset(&h, 0, sizeof(h));
+    uint16_t size = args[0], crc = args[1];
+    if (size && size <= image_max_size() && image_crc(size) == crc) {
+        h.magic = CONFIG_IMAGE_MAGIC;
+        h.config_crc = args[2];
+        uint8_t i;
+        for (i=0; i<sizeof(h.identify_hash); i++)
+            h.identify_hash[i] = READP(command_identify_hash[i]);
+        h.size = size;
+        h.crc = crc;
+    }
+    config_store_write(0, &h, sizeof(h));
+    command_config_image_query(NULL);
+}
+DECL_COMMAND_FLAGS(command_config_image_commit, HF_IN_SHUTDOWN,
+                   "config_image_commit size=%hu crc=%hu config_crc=%u");
@@ -87,7 +87,7 @@ void
 command_debug_ping(uint32_t *args)
 {
     uint8_t len = args[0];
-    char *data = (void*)(size_t)args[1];
+    char *data = command_decode_ptr(args[1]);
     sendf("pong data=%*s", len, data);
 }
 DECL_COMMAND_FLAGS(command_debug_ping, HF_IN_SHUTDOWN, "debug_ping data=%*s");
@@ -0,0 +1,59 @@
+// Config store backed by a file (for boards running on a host os)
+//
+// Copyright (C) 2017  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <errno.h> // errno
+#include <fcntl.h> // open
+#include <stdio.h> // fprintf
+#include <string.h> // memset
+#include <unistd.h> // pread
+#include "filestore.h" // filestore_setup
+#include "misc.h" // config_store_read
+
+#define FILESTORE_SIZE 8192
+
+static int store_fd = -1;
+
+// Open (or create) the file used to hold the config store
+int
+filestore_setup(const char *name)
+{
+    int fd = open(name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open store %s: %s\n"
+                , name, strerror(errno));
+        return -1;
+    }
+    store_fd = fd;
+    return 0;
+}
+
+// Return the size of the store (zero if no file was configured)
+uint16_t
+config_store_size(void)
+{
+    return store_fd < 0 ? 0 : FILESTORE_SIZE;
+}
+
+void
+config_store_read(uint16_t pos, void *data, uint16_t len)
+{
+    int ret = store_fd < 0 ? 0 : pread(store_fd, data, len, pos);
+    if (ret < 0)
+        ret = 0;
+    if (ret < len)
+        // Data past the end of the file reads as erased
+        memset((char*)data + ret, 0xff, len - ret);
+}
+
+void
+config_store_write(uint16_t pos, const void *data, uint16_t len)
+{
+    if (store_fd < 0)
+        return;
+    int ret = pwrite(store_fd, data, len, pos);
+    if (ret != len || fdatasync(store_fd))
+        fprintf(stderr, "Store write error: %s\n", strerror(errno));
+}
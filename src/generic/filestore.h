@@ -0,0 +1,6 @@
+#ifndef __GENERIC_FILESTORE_H
+#define __GENERIC_FILESTORE_H
+
+int filestore_setup(const char *name);
+
+#endif // filestore.h
@@ -18,4 +18,8 @@ void *dynmem_end(void);
 
 uint16_t crc16_ccitt(char *buf, uint8_t len);
 
+uint16_t config_store_size(void);
+void config_store_read(uint16_t pos, void *data, uint16_t len);
+void config_store_write(uint16_t pos, const void *data, uint16_t len);
+
 #endif // misc.h
@@ -1,4 +1,4 @@
-// TTY based IO
+// TTY and shared memory based IO
 //
 // Copyright (C) 2017  Kevin O'Connor <kevin@koconnor.net>
 //
@@ -10,6 +10,7 @@
 #include <pty.h> // openpty
 #include <stdio.h> // fprintf
 #include <string.h> // memmove
+#include <sys/mman.h> // shm_open
 #include <sys/stat.h> // chmod
 #include <sys/timerfd.h> // timerfd_create
 #include <time.h> // struct timespec
@@ -19,6 +20,7 @@
 #include "command.h" // command_find_block
 #include "internal.h" // console_setup
 #include "sched.h" // sched_wake_task
+#include "shmring.h" // shm_ring_read
 
 static struct pollfd main_pfd[2];
 #define MP_TIMER_IDX 0
@@ -64,8 +66,8 @@ set_close_on_exec(int fd)
     return 0;
 }
 
-int
-console_setup(char *name)
+static int
+console_setup_tty(char *name)
 {
     // Open pseudo-tty
     struct termios ti;
@@ -104,6 +106,89 @@ console_setup(char *name)
         report_errno("chmod", ret);
         return -1;
     }
+    return 0;
+}
+
+
+/****************************************************************
+ * Shared memory transport
+ ****************************************************************/
+
+static struct shm_console *shm;
+static int shm_wake_host_fd;
+
+// Wait up to one second for the host to make room in a full ring
+#define SHM_WRITE_RETRIES 10000
+static const struct timespec shm_write_retry_time = { 0, 100000 };
+
+// Create a doorbell fifo
+static int
+shm_open_doorbell(char *name, char *suffix)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "/tmp%s.%s", name, suffix);
+    unlink(path);
+    int ret = mkfifo(path, 0660);
+    if (ret) {
+        report_errno("mkfifo", ret);
+        return -1;
+    }
+    int fd = open(path, O_RDWR|O_NONBLOCK|O_CLOEXEC);
+    if (fd < 0) {
+        report_errno("open doorbell", fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int
+console_setup_shm(char *name)
+{
+    // Create shared memory segment
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0660);
+    if (fd < 0) {
+        report_errno("shm_open", fd);
+        return -1;
+    }
+    int ret = ftruncate(fd, sizeof(*shm));
+    if (ret) {
+        report_errno("ftruncate", ret);
+        return -1;
+    }
+    shm = mmap(NULL, sizeof(*shm), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED) {
+        report_errno("mmap", -1);
+        shm = NULL;
+        return -1;
+    }
+    close(fd);
+    memset(shm, 0, sizeof(*shm));
+    shm->ring_size = SHM_RING_SIZE;
+
+    // Create doorbells
+    int wake_mcu_fd = shm_open_doorbell(name, "wake_mcu");
+    if (wake_mcu_fd < 0)
+        return -1;
+    shm_wake_host_fd = shm_open_doorbell(name, "wake_host");
+    if (shm_wake_host_fd < 0)
+        return -1;
+    main_pfd[MP_TTY_IDX].fd = wake_mcu_fd;
+    main_pfd[MP_TTY_IDX].events = POLLIN;
+    __atomic_store_n(&shm->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int
+console_setup(char *name)
+{
+    int ret;
+    if (strncmp(name, "shm:", 4) == 0)
+        ret = console_setup_shm(name + 4);
+    else
+        ret = console_setup_tty(name);
+    if (ret)
+        return -1;
 
     // Make sure stderr is non-blocking
     ret = set_non_blocking(STDERR_FILENO);
@@ -129,7 +214,7 @@ console_setup(char *name)
 
 static struct task_wake console_wake;
 static char receive_buf[4096];
-static int receive_pos;
+static uint16_t receive_start, receive_end;
 
 // Process any incoming commands
 void
@@ -138,9 +223,25 @@ console_task(void)
     if (!sched_check_wake(&console_wake))
         return;
 
+    // Make room for new data - only a trailing partial block is moved
+    if (receive_start == receive_end) {
+        receive_start = receive_end = 0;
+    } else if (receive_end > sizeof(receive_buf) - MESSAGE_MAX) {
+        uint16_t len = receive_end - receive_start;
+        memmove(receive_buf, &receive_buf[receive_start], len);
+        receive_start = 0;
+        receive_end = len;
+    }
+
     // Read data
-    int ret = read(main_pfd[MP_TTY_IDX].fd, &receive_buf[receive_pos]
-                   , sizeof(receive_buf) - receive_pos);
+    int ret;
+    if (shm)
+        ret = shm_ring_read(&shm->to_mcu, main_pfd[MP_TTY_IDX].fd
+                            , (void*)&receive_buf[receive_end]
+                            , sizeof(receive_buf) - receive_end);
+    else
+        ret = read(main_pfd[MP_TTY_IDX].fd, &receive_buf[receive_end]
+                   , sizeof(receive_buf) - receive_end);
     if (ret < 0) {
         if (errno == EWOULDBLOCK) {
             ret = 0;
@@ -149,24 +250,13 @@ console_task(void)
             return;
         }
     }
-    if (ret == 15 && receive_buf[receive_pos+14] == '\n'
-        && memcmp(&receive_buf[receive_pos], "FORCE_SHUTDOWN\n", 15) == 0)
+    if (ret == 15 && receive_buf[receive_end+14] == '\n'
+        && memcmp(&receive_buf[receive_end], "FORCE_SHUTDOWN\n", 15) == 0)
         shutdown("Force shutdown command");
+    receive_end += ret;
 
-    // Find and dispatch message blocks in the input
-    int len = receive_pos + ret;
-    uint8_t pop_count, msglen = len > MESSAGE_MAX ? MESSAGE_MAX : len;
-    ret = command_find_block(receive_buf, msglen, &pop_count);
-    if (ret > 0)
-        command_dispatch(receive_buf, pop_count);
-    if (ret) {
-        len -= pop_count;
-        if (len) {
-            memmove(receive_buf, &receive_buf[pop_count], len);
-            sched_wake_task(&console_wake);
-        }
-    }
-    receive_pos = len;
+    // Dispatch all complete message blocks in the input
+    command_dispatch_all(receive_buf, &receive_start, receive_end);
 }
 DECL_TASK(console_task);
 
@@ -180,14 +270,28 @@ console_sendf(const struct command_encoder *ce, va_list args)
     command_add_frame(buf, msglen);
 
     // Transmit message
-    int ret = write(main_pfd[MP_TTY_IDX].fd, buf, msglen);
+    int ret;
+    if (shm) {
+        // If the ring is full, give the host time to drain it
+        int retries = SHM_WRITE_RETRIES;
+        for (;;) {
+            ret = shm_ring_write(&shm->to_host, shm_wake_host_fd, (void*)buf
+                                 , msglen);
+            if (ret >= 0 || errno != ENOBUFS || !retries--)
+                break;
+            nanosleep(&shm_write_retry_time, NULL);
+        }
+    } else {
+        ret = write(main_pfd[MP_TTY_IDX].fd, buf, msglen);
+    }
     if (ret < 0)
         report_errno("write", ret);
 }
 
-// Sleep until the specified time (waking early for console input if needed)
-void
-console_sleep(struct timespec ts)
+// Wait until the specified time or until console input is available
+// (returns non-zero if woken early for console input)
+int
+console_wait(struct timespec ts)
 {
     struct itimerspec its;
     its.it_interval = (struct timespec){0, 0};
@@ -196,15 +300,25 @@ console_sleep(struct timespec ts)
                               , &its, NULL);
     if (ret < 0) {
         report_errno("timerfd_settime", ret);
-        return;
+        return 0;
     }
     ret = poll(main_pfd, ARRAY_SIZE(main_pfd), -1);
     if (ret <= 0) {
         report_errno("poll main_pfd", ret);
-        return;
+        return 0;
     }
-    if (main_pfd[MP_TTY_IDX].revents)
+    if (main_pfd[MP_TTY_IDX].revents) {
         sched_wake_task(&console_wake);
+        return 1;
+    }
+    return 0;
+}
+
+// Sleep until the specified time (waking early for console input if needed)
+void
+console_sleep(struct timespec ts)
+{
+    console_wait(ts);
     if (main_pfd[MP_TIMER_IDX].revents)
         irq_poll();
 }
@@ -8,10 +8,12 @@
 void report_errno(char *where, int rc);
 int set_non_blocking(int fd);
 int console_setup(char *name);
+int console_wait(struct timespec ts);
 void console_sleep(struct timespec ts);
 
 // timer.c
 int timer_check_periodic(struct timespec *ts);
+void timer_set_wait(long wait_ns, long spin_ns);
 
 // watchdog.c
 int watchdog_setup(void);
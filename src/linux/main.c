@@ -4,12 +4,17 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#define _GNU_SOURCE // CPU_SET
 #include </usr/include/sched.h> // sched_setscheduler
 #include <stdio.h> // fprintf
+#include <stdlib.h> // atoi
 #include <string.h> // memset
+#include <sys/mman.h> // mlockall
 #include <unistd.h> // getopt
+#include "autoconf.h" // CONFIG_WANT_CONFIG_IMAGE
 #include "board/misc.h" // console_sendf
 #include "command.h" // DECL_CONSTANT
+#include "generic/filestore.h" // filestore_setup
 #include "internal.h" // console_setup
 #include "sched.h" // sched_main
 
@@ -20,17 +25,42 @@ DECL_CONSTANT(MCU, "linux");
  * Real-time setup
  ****************************************************************/
 
+// Default time to busy-wait before a timer when in realtime mode
+#define REALTIME_SPIN_NS 10000
+// Wait inline (instead of returning to the main loop) for timers
+// that are this close when in realtime mode
+#define REALTIME_WAIT_NS 200000
+
 static int
-realtime_setup(void)
+realtime_setup(int priority, int cpu, long spin_ns)
 {
+    // Avoid page faults during operation
+    int ret = mlockall(MCL_CURRENT | MCL_FUTURE);
+    if (ret < 0) {
+        report_errno("mlockall", ret);
+        return -1;
+    }
+    if (cpu >= 0) {
+        cpu_set_t cs;
+        CPU_ZERO(&cs);
+        CPU_SET(cpu, &cs);
+        ret = sched_setaffinity(0, sizeof(cs), &cs);
+        if (ret < 0) {
+            report_errno("sched_setaffinity", ret);
+            return -1;
+        }
+    }
     struct sched_param sp;
     memset(&sp, 0, sizeof(sp));
-    sp.sched_priority = 1;
-    int ret = sched_setscheduler(0, SCHED_FIFO, &sp);
+    sp.sched_priority = priority;
+    ret = sched_setscheduler(0, SCHED_FIFO, &sp);
     if (ret < 0) {
         report_errno("sched_setscheduler", ret);
         return -1;
     }
+    // Wait (via console_wait) until shortly before upcoming timers and
+    // then spin until they are due
+    timer_set_wait(REALTIME_WAIT_NS, spin_ns);
     return 0;
 }
 
@@ -61,8 +91,10 @@ main(int argc, char **argv)
 {
     // Parse program args
     orig_argv = argv;
-    int opt, watchdog = 0, realtime = 0;
-    while ((opt = getopt(argc, argv, "wr")) != -1) {
+    int opt, watchdog = 0, realtime = 0, priority = 1, cpu = -1;
+    long spin_ns = REALTIME_SPIN_NS;
+    char *console = "/tmp/klipper_host_mcu", *store = NULL;
+    while ((opt = getopt(argc, argv, "wrp:c:s:I:f:")) != -1) {
         switch (opt) {
         case 'w':
             watchdog = 1;
@@ -70,21 +102,44 @@ main(int argc, char **argv)
         case 'r':
             realtime = 1;
             break;
+        case 'p':
+            priority = atoi(optarg);
+            break;
+        case 'c':
+            cpu = atoi(optarg);
+            break;
+        case 's':
+            spin_ns = atol(optarg);
+            break;
+        case 'I':
+            console = optarg;
+            break;
+        case 'f':
+            store = optarg;
+            break;
         default:
-            fprintf(stderr, "Usage: %s [-w] [-r]\n", argv[0]);
+            fprintf(stderr, "Usage: %s [-w] [-r] [-p <priority>] [-c <cpu>]"
+                    " [-s <spin_ns>] [-I <path> | -I shm:/<name>]"
+                    " [-f <config store file>]\n"
+                    , argv[0]);
             return -1;
         }
     }
 
     // Initial setup
     if (realtime) {
-        int ret = realtime_setup();
+        int ret = realtime_setup(priority, cpu, spin_ns);
         if (ret)
             return ret;
     }
-    int ret = console_setup("/tmp/klipper_host_mcu");
+    int ret = console_setup(console);
     if (ret)
         return -1;
+    if (CONFIG_WANT_CONFIG_IMAGE && store) {
+        int ret = filestore_setup(store);
+        if (ret)
+            return ret;
+    }
     if (watchdog) {
         int ret = watchdog_setup();
         if (ret)
@@ -0,0 +1,89 @@
+#ifndef __LINUX_SHMRING_H
+#define __LINUX_SHMRING_H
+// Shared memory byte rings used between klippy and a linux mcu process
+//
+// Copyright (C) 2017  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+//
+// The host and mcu exchange the regular framed message blocks over a
+// pair of byte rings.  A named fifo "doorbell" is written only when
+// the reader may be waiting.  The segment layout must match the host
+// copy of this code in klippy/shmring.h.
+
+#include <errno.h> // errno
+#include <stdint.h> // uint32_t
+#include <string.h> // memcpy
+#include <unistd.h> // write
+#include "internal.h" // report_errno
+
+#define SHM_MAGIC 0x4d48534b // "KSHM"
+#define SHM_RING_SIZE 8192
+
+struct shm_ring {
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+    uint32_t wake_pending __attribute__((aligned(64)));
+    uint8_t data[SHM_RING_SIZE] __attribute__((aligned(64)));
+};
+
+struct shm_console {
+    uint32_t magic, ring_size;
+    struct shm_ring to_mcu, to_host;
+};
+
+// Notify the reader of a ring (if it has not already been notified)
+static inline void
+shm_ring_wake(struct shm_ring *r, int wake_fd)
+{
+    if (!__atomic_exchange_n(&r->wake_pending, 1, __ATOMIC_SEQ_CST)) {
+        int ret = write(wake_fd, ".", 1);
+        if (ret < 0 && errno != EWOULDBLOCK)
+            report_errno("write doorbell", ret);
+    }
+}
+
+// Add data to a ring
+static inline int
+shm_ring_write(struct shm_ring *r, int wake_fd, uint8_t *buf, uint32_t len)
+{
+    uint32_t head = r->head, tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (SHM_RING_SIZE - (head - tail) < len) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    uint32_t pos = head % SHM_RING_SIZE, wrap = SHM_RING_SIZE - pos;
+    if (wrap > len)
+        wrap = len;
+    memcpy(&r->data[pos], buf, wrap);
+    memcpy(r->data, buf + wrap, len - wrap);
+    __atomic_store_n(&r->head, head + len, __ATOMIC_SEQ_CST);
+    shm_ring_wake(r, wake_fd);
+    return len;
+}
+
+// Extract data from a ring and rearm its doorbell
+static inline int
+shm_ring_read(struct shm_ring *r, int wake_fd, uint8_t *buf, uint32_t len)
+{
+    char dummy[64];
+    while (read(wake_fd, dummy, sizeof(dummy)) > 0)
+        ;
+    __atomic_store_n(&r->wake_pending, 0, __ATOMIC_SEQ_CST);
+    uint32_t tail = r->tail, head = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+    uint32_t avail = head - tail;
+    if (avail > len)
+        avail = len;
+    uint32_t pos = tail % SHM_RING_SIZE, wrap = SHM_RING_SIZE - pos;
+    if (wrap > avail)
+        wrap = avail;
+    memcpy(buf, &r->data[pos], wrap);
+    memcpy(buf + wrap, r->data, avail - wrap);
+    __atomic_store_n(&r->tail, tail + avail, __ATOMIC_RELEASE);
+    if (head - tail > avail)
+        // More data pending - make sure the reader is woken again
+        shm_ring_wake(r, wake_fd);
+    return avail;
+}
+
+#endif // shmring.h
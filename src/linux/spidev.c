@@ -62,7 +62,7 @@ command_send_spi(uint32_t *args)
 {
     int fd = spi_open(args[0], args[1]);
     uint8_t len = args[2];
-    char *msg = (void*)(size_t)args[3];
+    char *msg = command_decode_ptr(args[3]);
     spi_write(fd, msg, len);
 }
 DECL_COMMAND(command_send_spi, "send_spi bus=%u dev=%u msg=%*s");
@@ -60,7 +60,8 @@ timespec_from_time(uint32_t time)
     return ts;
 }
 
-// Add a given number of nanoseconds to a 'struct timespec'
+// Add a given number of nanoseconds (which may be negative) to a
+// 'struct timespec'
 static inline struct timespec
 timespec_add(struct timespec ts, long ns)
 {
@@ -68,6 +69,9 @@ timespec_add(struct timespec ts, long ns)
     if (ts.tv_nsec >= NSECS) {
         ts.tv_sec++;
         ts.tv_nsec -= NSECS;
+    } else if (ts.tv_nsec < 0) {
+        ts.tv_sec--;
+        ts.tv_nsec += NSECS;
     }
     return ts;
 }
@@ -145,10 +149,42 @@ static struct timespec timer_repeat_until;
 #define TIMER_MIN_TRY_NS 1000
 #define TIMER_DEFER_REPEAT_NS 5000
 
+// The main loop wakes timer_wait_ns before the next timer and then
+// waits for it in timer_dispatch().  Only the final timer_spin_ns of
+// that wait is a busy-wait - the rest is spent sleeping in
+// console_wait() so that incoming commands are not delayed by it.
+static long timer_wait_ns, timer_spin_ns = TIMER_MIN_TRY_NS;
+
+void
+timer_set_wait(long wait_ns, long spin_ns)
+{
+    if (spin_ns < TIMER_MIN_TRY_NS)
+        spin_ns = TIMER_MIN_TRY_NS;
+    timer_wait_ns = wait_ns;
+    timer_spin_ns = spin_ns;
+}
+
+// Wait until the given time (returns non-zero if the wait was
+// abandoned so that pending console input can be processed)
+static int
+timer_wait_until(struct timespec nt, struct timespec now)
+{
+    struct timespec spin_start = timespec_add(nt, -timer_spin_ns);
+    if (timespec_is_before(now, spin_start) && console_wait(spin_start))
+        return 1;
+    while (unlikely(timespec_is_before(now, nt)))
+        now = timespec_read();
+    return 0;
+}
+
 // Invoke timers
 static void
-timer_dispatch(void)
+timer_dispatch(struct timespec now)
 {
+    // On console input let the console task run - irq_poll() will
+    // then return here as next_wake_time is unchanged
+    if (timer_wait_until(next_wake_time, now))
+        return;
     struct timespec tru = timer_repeat_until;
     for (;;) {
         // Run the next software timer
@@ -156,7 +192,8 @@ timer_dispatch(void)
         struct timespec nt = timespec_from_time(next);
 
         struct timespec now = timespec_read();
-        if (!timespec_is_before(nt, timespec_add(now, TIMER_MIN_TRY_NS))) {
+        if (!timespec_is_before(
+                nt, timespec_add(now, TIMER_MIN_TRY_NS + timer_wait_ns))) {
             // Schedule next timer normally.
             next_wake_time = nt;
             return;
@@ -175,8 +212,10 @@ timer_dispatch(void)
         }
 
         // Next timer in the past or near future - wait for it to be ready
-        while (unlikely(timespec_is_before(now, nt)))
-            now = timespec_read();
+        if (timer_wait_until(nt, now)) {
+            next_wake_time = nt;
+            return;
+        }
     }
 }
 
@@ -219,12 +258,13 @@ irq_restore(irqstatus_t flag)
 void
 irq_wait(void)
 {
-    console_sleep(next_wake_time);
+    console_sleep(timespec_add(next_wake_time, -timer_wait_ns));
 }
 
 void
 irq_poll(void)
 {
-    if (!timespec_is_before(timespec_read(), next_wake_time))
-        timer_dispatch();
+    struct timespec now = timespec_read();
+    if (!timespec_is_before(now, timespec_add(next_wake_time, -timer_wait_ns)))
+        timer_dispatch(now);
 }
@@ -135,12 +135,31 @@ sched_del_timer(struct timer *del)
     irq_restore(flag);
 }
 
+// Check if any timers (other than the internal periodic timer) are
+// scheduled
+uint8_t
+sched_timers_pending(void)
+{
+    irqstatus_t flag = irq_save();
+    struct timer *pos;
+    uint8_t pending = 0;
+    for (pos = timer_list; pos != &sentinel_timer; pos = pos->next)
+        if (pos != &periodic_timer && pos != &deleted_timer) {
+            pending = 1;
+            break;
+        }
+    irq_restore(flag);
+    return pending;
+}
+
 // Invoke the next timer - called from board hardware irq code.
 unsigned int
 sched_timer_dispatch(void)
 {
     // Invoke timer callback
     struct timer *t = timer_list;
+    if (CONFIG_TIMER_STATS)
+        stats_note_timer(timer_read_time() - t->waketime);
     uint_fast8_t res;
     uint32_t updated_waketime;
     if (CONFIG_INLINE_STEPPER_HACK && likely(!t->func)) {
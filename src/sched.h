@@ -28,6 +28,7 @@ struct task_wake {
 // sched.c
 void sched_add_timer(struct timer*);
 void sched_del_timer(struct timer *del);
+uint8_t sched_timers_pending(void);
 unsigned int sched_timer_dispatch(void);
 void sched_timer_reset(void);
 void sched_wake_tasks(void);
@@ -5,13 +5,51 @@
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include "board/gpio.h" // gpio_out_write
+#include "command.h" // DECL_CONSTANT
+#include "internal.h" // gpio_trace
+
+
+/****************************************************************
+ * Output edge recording
+ ****************************************************************/
+
+FILE *gpio_trace;
+uint64_t gpio_edge_count;
+static uint8_t gpio_state[256];
+
+// Note a (possible) change of an output pin at the current virtual time
+static void
+gpio_record(uint8_t pin, uint8_t val)
+{
+    if (gpio_state[pin] == val)
+        return;
+    gpio_state[pin] = val;
+    gpio_edge_count++;
+    if (gpio_trace)
+        fprintf(gpio_trace, "%llu %u %u\n"
+                , (unsigned long long)timer_read_time64(), pin, val);
+}
+
+
+/****************************************************************
+ * Pin functions
+ ****************************************************************/
+
+DECL_CONSTANT(PWM_MAX, 255);
+DECL_CONSTANT(ADC_MAX, 4095);
+
+// Analog inputs report a fixed mid-scale value
+#define ADC_SIM_VALUE 2048
 
 struct gpio_out gpio_out_setup(uint8_t pin, uint8_t val) {
+    gpio_record(pin, !!val);
     return (struct gpio_out){.pin=pin};
 }
 void gpio_out_toggle(struct gpio_out g) {
+    gpio_record(g.pin, !gpio_state[g.pin]);
 }
 void gpio_out_write(struct gpio_out g, uint8_t val) {
+    gpio_record(g.pin, !!val);
 }
 struct gpio_in gpio_in_setup(uint8_t pin, int8_t pull_up) {
     return (struct gpio_in){.pin=pin};
@@ -20,9 +58,11 @@ uint8_t gpio_in_read(struct gpio_in g) {
     return 0;
 }
 struct gpio_pwm gpio_pwm_setup(uint8_t pin, uint32_t cycle_time, uint8_t val) {
+    gpio_record(pin, val);
     return (struct gpio_pwm){.pin=pin};
 }
 void gpio_pwm_write(struct gpio_pwm g, uint8_t val) {
+    gpio_record(g.pin, val);
 }
 struct gpio_adc gpio_adc_setup(uint8_t pin) {
     return (struct gpio_adc){.pin=pin};
@@ -31,7 +71,7 @@ uint32_t gpio_adc_sample(struct gpio_adc g) {
     return 0;
 }
 uint16_t gpio_adc_read(struct gpio_adc g) {
-    return 0;
+    return ADC_SIM_VALUE;
 }
 void gpio_adc_cancel_sample(struct gpio_adc g) {
 }
@@ -0,0 +1,15 @@
+#ifndef __SIMU_INTERNAL_H
+#define __SIMU_INTERNAL_H
+// Local definitions for the host simulator
+
+#include <stdint.h> // uint64_t
+#include <stdio.h> // FILE
+
+// main.c
+uint64_t timer_read_time64(void);
+
+// gpio.c
+extern FILE *gpio_trace;
+extern uint64_t gpio_edge_count;
+
+#endif // internal.h
@@ -3,14 +3,33 @@
 // Copyright (C) 2016  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
+//
+// The simulator runs the firmware against a virtual clock.  It reads
+// a stream of message blocks (as generated by "klippy.py -o") and
+// advances the clock directly to the next scheduled timer whenever
+// it must wait - so a print is simulated much faster than real time
+// and the results (eg, the recorded gpio edges) are deterministic.
 
-#include <fcntl.h>
-#include <stdio.h>
-#include <unistd.h>
-#include "board/misc.h" // timer_from_us
+#include <errno.h> // errno
+#include <fcntl.h> // open
+#include <stdio.h> // fprintf
+#include <stdlib.h> // exit
+#include <string.h> // memmove
+#include <time.h> // clock_gettime
+#include <unistd.h> // getopt
+#include "autoconf.h" // CONFIG_CLOCK_FREQ
+#include "basecmd.h" // move_queue_info
 #include "board/irq.h" // irq_disable
+#include "board/misc.h" // timer_from_us
+#include "command.h" // DECL_CONSTANT
+#include "generic/filestore.h" // filestore_setup
+#include "internal.h" // gpio_trace
 #include "sched.h" // sched_main
 
+DECL_CONSTANT(MCU, "simulator");
+
+static void simu_exit(int status);
+
 
 /****************************************************************
  * Interrupts
@@ -47,75 +66,306 @@ irq_restore(irqstatus_t flag)
     Interrupt_off = flag;
 }
 
-void
-irq_wait(void)
-{
-}
-
-void
-irq_poll(void)
-{
-}
-
 
 /****************************************************************
  * Timers
  ****************************************************************/
 
+DECL_CONSTANT(CLOCK_FREQ, CONFIG_CLOCK_FREQ);
+
+static uint64_t simu_time;
+static uint32_t next_wake_time;
+static uint64_t timer_events, timer_ns;
+
+// Return a (host) nanosecond counter for cost measurements
+static uint64_t
+host_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Return the number of clock ticks for a given number of microseconds
 uint32_t
 timer_from_us(uint32_t us)
 {
-    return 0; // XXX
+    return us * (CONFIG_CLOCK_FREQ / 1000000);
 }
 
+// Return true if time1 is before time2.  Always use this function to
+// compare times as regular C comparisons can fail if the counter
+// rolls over.
 uint8_t
 timer_is_before(uint32_t time1, uint32_t time2)
 {
     return (int32_t)(time1 - time2) < 0;
 }
 
+// Return the current virtual time (in clock ticks)
 uint32_t
 timer_read_time(void)
 {
-    return 0; // XXX
+    return simu_time;
+}
+
+// Return the current virtual time as a 64bit counter
+uint64_t
+timer_read_time64(void)
+{
+    return simu_time;
 }
 
+// Activate timer dispatch as soon as possible
 void
 timer_kick(void)
 {
+    next_wake_time = simu_time;
+}
+
+// Advance the virtual clock to the next timer and run all due timers
+static void
+timer_dispatch(void)
+{
+    int32_t diff = next_wake_time - (uint32_t)simu_time;
+    if (diff > 0)
+        simu_time += diff;
+    uint64_t start = host_ns();
+    for (;;) {
+        uint32_t next = sched_timer_dispatch();
+        timer_events++;
+        if (timer_is_before(simu_time, next)) {
+            next_wake_time = next;
+            break;
+        }
+    }
+    timer_ns += host_ns() - start;
 }
 
 
 /****************************************************************
- * Turn stdin/stdout into serial console
+ * Console input/output
  ****************************************************************/
 
+static int input_fd = STDIN_FILENO, output_fd = -1;
+static struct task_wake console_wake;
+static char receive_buf[4096];
+static uint16_t receive_start, receive_end;
+static uint8_t input_done;
+static uint64_t block_count, block_ns;
+
+// Number of free move queue items required before dispatching the
+// next message block (a block may contain several queue_step commands)
+#define MOVE_RESERVE 16
+
+// Check if the next message block may be dispatched now (if not, the
+// virtual clock must advance so that queued moves complete)
+static int
+console_can_dispatch(void)
+{
+    if (input_done)
+        return 0;
+    uint16_t free_count, count;
+    move_queue_info(&free_count, &count);
+    return free_count >= (count < MOVE_RESERVE ? count : MOVE_RESERVE);
+}
+
+// Read more input data (blocking until data is available)
+static int
+console_fill(void)
+{
+    if (receive_start == receive_end) {
+        receive_start = receive_end = 0;
+    } else if (receive_end > sizeof(receive_buf) - MESSAGE_MAX) {
+        uint16_t len = receive_end - receive_start;
+        memmove(receive_buf, &receive_buf[receive_start], len);
+        receive_start = 0;
+        receive_end = len;
+    }
+    int ret = read(input_fd, &receive_buf[receive_end]
+                   , sizeof(receive_buf) - receive_end);
+    if (ret <= 0) {
+        if (ret < 0)
+            fprintf(stderr, "Input read error: %s\n", strerror(errno));
+        input_done = 1;
+        return -1;
+    }
+    receive_end += ret;
+    return 0;
+}
+
+// Find the next valid message block in the input.  The input is a
+// recording with no retransmits, so sequence numbers are not checked.
+static int
+console_find_block(void)
+{
+    for (;;) {
+        char *buf = &receive_buf[receive_start];
+        uint16_t avail = receive_end - receive_start;
+        if (avail < MESSAGE_MIN)
+            return 0;
+        uint8_t msglen = buf[MESSAGE_POS_LEN];
+        if (msglen >= MESSAGE_MIN && msglen <= MESSAGE_MAX
+            && (buf[MESSAGE_POS_SEQ] & ~MESSAGE_SEQ_MASK) == MESSAGE_DEST) {
+            if (avail < msglen)
+                return 0;
+            uint16_t crc = crc16_ccitt(buf, msglen - MESSAGE_TRAILER_SIZE);
+            if (buf[msglen - MESSAGE_TRAILER_SYNC] == MESSAGE_SYNC
+                && buf[msglen - MESSAGE_TRAILER_CRC] == (char)(crc >> 8)
+                && buf[msglen - MESSAGE_TRAILER_CRC + 1] == (char)crc)
+                return msglen;
+        }
+        // Skip invalid data
+        receive_start++;
+    }
+}
+
+// Process incoming commands
+void
+console_task(void)
+{
+    if (!sched_check_wake(&console_wake))
+        return;
+    while (console_can_dispatch()) {
+        int msglen = console_find_block();
+        if (!msglen) {
+            if (console_fill())
+                return;
+            continue;
+        }
+        char *buf = &receive_buf[receive_start];
+        receive_start += msglen;
+        uint64_t start = host_ns();
+        command_dispatch(buf, msglen);
+        block_ns += host_ns() - start;
+        block_count++;
+    }
+}
+DECL_TASK(console_task);
+
 // Encode and transmit a "response" message
 void
 console_sendf(const struct command_encoder *ce, va_list args)
 {
+    if (output_fd < 0)
+        return;
+    char buf[MESSAGE_MAX];
+    uint8_t msglen = command_encodef(buf, ce, args);
+    command_add_frame(buf, msglen);
+    int ret = write(output_fd, buf, msglen);
+    if (ret < 0)
+        fprintf(stderr, "Output write error: %s\n", strerror(errno));
 }
 
 
 /****************************************************************
- * Startup
+ * Idle handling
  ****************************************************************/
 
-// Periodically sleep so we don't consume all CPU
+// Maximum simulated time to run timers after the end of input (some
+// timers, such as a soft pwm cycle, never complete)
+#define DRAIN_TIME 60
+static uint64_t drain_end;
+
+// Called when no tasks are pending - either dispatch more input or
+// advance the virtual clock to the next timer
 void
-simu_pause(void)
+irq_wait(void)
+{
+    if (sched_is_shutdown()) {
+        fprintf(stderr, "Firmware shutdown at clock %llu\n"
+                , (unsigned long long)simu_time);
+        simu_exit(1);
+    }
+    if (console_can_dispatch()) {
+        sched_wake_task(&console_wake);
+        return;
+    }
+    if (input_done) {
+        // A move frees its queue item when it is loaded, so wait for
+        // the stepper timers (and any other timers) to complete
+        if (!sched_timers_pending())
+            simu_exit(0);
+        if (!drain_end)
+            drain_end = simu_time + (uint64_t)DRAIN_TIME * CONFIG_CLOCK_FREQ;
+        if (simu_time > drain_end) {
+            fprintf(stderr, "Timers still pending %d seconds after the"
+                    " end of input\n", DRAIN_TIME);
+            simu_exit(0);
+        }
+    }
+    timer_dispatch();
+}
+
+void
+irq_poll(void)
+{
+}
+
+
+/****************************************************************
+ * Startup
+ ****************************************************************/
+
+// Report simulation statistics and exit
+static void
+simu_exit(int status)
 {
-    // XXX - should check that no timers are present.
-    usleep(1);
+    if (gpio_trace)
+        fflush(gpio_trace);
+    double secs = (double)simu_time / CONFIG_CLOCK_FREQ;
+    fprintf(stderr, "Simulated %.3f seconds (%llu ticks):"
+            " %llu timer events (%.1fns each), %llu gpio edges,"
+            " %llu message blocks (%.1fns each)\n"
+            , secs, (unsigned long long)simu_time
+            , (unsigned long long)timer_events
+            , timer_events ? (double)timer_ns / timer_events : 0.
+            , (unsigned long long)gpio_edge_count
+            , (unsigned long long)block_count
+            , block_count ? (double)block_ns / block_count : 0.);
+    exit(status);
 }
-DECL_TASK(simu_pause);
 
 // Main entry point for simulator.
 int
-main(void)
+main(int argc, char **argv)
 {
-    // Make stdin non-blocking
-    fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL, 0) | O_NONBLOCK);
+    // Parse program args
+    int opt;
+    while ((opt = getopt(argc, argv, "i:o:g:f:")) != -1) {
+        switch (opt) {
+        case 'i':
+            input_fd = open(optarg, O_RDONLY);
+            if (input_fd < 0) {
+                fprintf(stderr, "Unable to open %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'o':
+            output_fd = open(optarg, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+            if (output_fd < 0) {
+                fprintf(stderr, "Unable to open %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'g':
+            gpio_trace = fopen(optarg, "w");
+            if (!gpio_trace) {
+                fprintf(stderr, "Unable to open %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'f':
+            if (!CONFIG_WANT_CONFIG_IMAGE || filestore_setup(optarg))
+                return -1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-i <input>] [-o <responses>]"
+                    " [-g <gpio_trace>] [-f <config store file>]\n"
+                    , argv[0]);
+            return -1;
+        }
+    }
 
     sched_main();
     return 0;
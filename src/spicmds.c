@@ -12,7 +12,7 @@ command_send_spi_message(uint32_t *args)
 {
     // For now, this only implements enough to program an ad5206 digipot
     uint8_t len = args[1];
-    char *msg = (void*)(size_t)args[2];
+    char *msg = command_decode_ptr(args[2]);
     spi_config();
     struct gpio_out pin = gpio_out_setup(args[0], 0);
     spi_transfer(msg, len);
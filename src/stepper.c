@@ -18,15 +18,22 @@
  * Steppers
  ****************************************************************/
 
+// A queued move is stored packed and linked to the next move by its
+// move_alloc() index so that more moves fit in a given amount of ram.
 struct stepper_move {
     uint32_t interval;
     int16_t add;
     uint16_t count;
-    struct stepper_move *next;
-    uint8_t flags;
-};
+    uint16_t next;
+} PACKED;
+
+enum { MF_DIR=1<<15, MF_NEXT=MF_DIR-1 };
 
-enum { MF_DIR=1<<0 };
+// Bytes of ram used for each queued move
+#define MOVE_SIZE 10
+DECL_CONSTANT(STEPPER_MOVE_SIZE, MOVE_SIZE);
+_Static_assert(sizeof(struct stepper_move) == MOVE_SIZE
+               , "Invalid stepper move size");
 
 struct stepper {
     struct timer time;
@@ -41,7 +48,7 @@ struct stepper {
 #endif
     struct gpio_out step_pin, dir_pin;
     uint32_t position;
-    struct stepper_move *first, **plast;
+    uint16_t first, last;
     uint32_t min_stop_interval;
     // gcc (pre v6) does better optimization when uint8_t are bitfields
     uint8_t flags : 8;
@@ -56,15 +63,17 @@ enum { SF_LAST_DIR=1<<0, SF_NEXT_DIR=1<<1, SF_INVERT_STEP=1<<2, SF_HAVE_ADD=1<<3
 static uint_fast8_t
 stepper_load_next(struct stepper *s, uint32_t min_next_time)
 {
-    struct stepper_move *m = s->first;
-    if (!m) {
+    uint16_t mi = s->first;
+    if (!mi) {
         if (s->interval - s->add < s->min_stop_interval
             && !(s->flags & SF_NO_NEXT_CHECK))
             shutdown("No next step");
         s->count = 0;
         return SF_DONE;
     }
+    struct stepper_move *m = move_get(mi);
 
+    move_note_done(s->next_step_time);
     s->next_step_time += m->interval;
     s->add = m->add;
     s->interval = m->interval + m->add;
@@ -86,15 +95,15 @@ stepper_load_next(struct stepper *s, uint32_t min_next_time)
         }
         s->count = m->count * 2;
     }
-    if (m->flags & MF_DIR) {
+    if (m->next & MF_DIR) {
         s->position = -s->position + m->count;
         gpio_out_toggle(s->dir_pin);
     } else {
         s->position += m->count;
     }
 
-    s->first = m->next;
-    move_free(m);
+    s->first = m->next & MF_NEXT;
+    move_free(mi);
     return SF_RESCHEDULE;
 }
 
@@ -162,11 +171,27 @@ DECL_COMMAND(command_config_stepper,
              "config_stepper oid=%c step_pin=%c dir_pin=%c"
              " min_stop_interval=%u invert_step=%c");
 
+// Table of steppers indexed by oid (built when the config is finalized)
+static struct stepper **stepper_table;
+static uint8_t stepper_table_count;
+
+void
+stepper_finalize(void)
+{
+    stepper_table = (void*)oid_table_alloc(command_config_stepper
+                                           , &stepper_table_count);
+}
+DECL_FINALIZE(stepper_finalize);
+
 // Return the 'struct stepper' for a given stepper oid
 struct stepper *
 stepper_oid_lookup(uint8_t oid)
 {
-    return oid_lookup(oid, command_config_stepper);
+    if (CONFIG_DEBUG_OID_CHECKS || !stepper_table)
+        return oid_lookup(oid, command_config_stepper);
+    if (oid >= stepper_table_count || !stepper_table[oid])
+        shutdown("Invalid stepper oid");
+    return stepper_table[oid];
 }
 
 // Schedule a set of steps with a given timing
@@ -174,41 +199,43 @@ void
 command_queue_step(uint32_t *args)
 {
     struct stepper *s = stepper_oid_lookup(args[0]);
-    struct stepper_move *m = move_alloc();
+    uint16_t mi = move_alloc();
+    struct stepper_move *m = move_get(mi);
     m->interval = args[1];
     m->count = args[2];
     if (!m->count)
         shutdown("Invalid count parameter");
     m->add = args[3];
-    m->next = NULL;
-    m->flags = 0;
+    m->next = 0;
 
     irq_disable();
     uint8_t flags = s->flags;
     if (!!(flags & SF_LAST_DIR) != !!(flags & SF_NEXT_DIR)) {
         flags ^= SF_LAST_DIR;
-        m->flags |= MF_DIR;
+        m->next = MF_DIR;
     }
     flags &= ~SF_NO_NEXT_CHECK;
-    if (m->count == 1 && (m->flags || flags & SF_LAST_RESET))
+    if (m->count == 1 && (m->next || flags & SF_LAST_RESET))
         // count=1 moves after a reset or dir change can have small intervals
         flags |= SF_NO_NEXT_CHECK;
     s->flags = flags & ~SF_LAST_RESET;
     if (s->count) {
-        if (s->first)
-            *s->plast = m;
-        else
-            s->first = m;
-        s->plast = &m->next;
+        if (s->first) {
+            struct stepper_move *last = move_get(s->last);
+            last->next |= mi;
+        } else {
+            s->first = mi;
+        }
+        s->last = mi;
     } else {
-        s->first = m;
+        s->first = mi;
         stepper_load_next(s, s->next_step_time + m->interval);
         sched_add_timer(&s->time);
     }
     irq_enable();
 }
-DECL_COMMAND(command_queue_step,
-             "queue_step oid=%c interval=%u count=%hu add=%hi");
+DECL_COMMAND_FLAGS(command_queue_step, HF_FAST_PARSE,
+                   "queue_step oid=%c interval=%u count=%hu add=%hi");
 
 // Set the direction of the next queued step
 void
@@ -220,7 +247,8 @@ command_set_next_step_dir(uint32_t *args)
     s->flags = (s->flags & ~SF_NEXT_DIR) | nextdir;
     irq_enable();
 }
-DECL_COMMAND(command_set_next_step_dir, "set_next_step_dir oid=%c dir=%c");
+DECL_COMMAND_FLAGS(command_set_next_step_dir, HF_FAST_PARSE,
+                   "set_next_step_dir oid=%c dir=%c");
 
 // Set an absolute time that the next step will be relative to
 void
@@ -235,7 +263,8 @@ command_reset_step_clock(uint32_t *args)
     s->flags |= SF_LAST_RESET;
     irq_enable();
 }
-DECL_COMMAND(command_reset_step_clock, "reset_step_clock oid=%c clock=%u");
+DECL_COMMAND_FLAGS(command_reset_step_clock, HF_FAST_PARSE,
+                   "reset_step_clock oid=%c clock=%u");
 
 // Return the current stepper position.  Caller must disable irqs.
 static uint32_t
@@ -277,7 +306,8 @@ stepper_stop(struct stepper *s)
     gpio_out_write(s->dir_pin, 0);
     gpio_out_write(s->step_pin, s->flags & SF_INVERT_STEP);
     while (s->first) {
-        struct stepper_move *next = s->first->next;
+        struct stepper_move *m = move_get(s->first);
+        uint16_t next = m->next & MF_NEXT;
         move_free(s->first);
         s->first = next;
     }
@@ -289,8 +319,11 @@ stepper_shutdown(void)
     uint8_t i;
     struct stepper *s;
     foreach_oid(i, s, command_config_stepper) {
-        s->first = NULL;
+        s->first = 0;
         stepper_stop(s);
     }
+    // The config can only be reset after a shutdown, so discard the
+    // table here (it is rebuilt when the new config is finalized)
+    stepper_table = NULL;
 }
 DECL_SHUTDOWN(stepper_shutdown);